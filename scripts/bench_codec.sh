@@ -0,0 +1,59 @@
+#!/usr/bin/env bash
+#
+# Created by Yen-Chung Chen on 10/16/26.
+#
+# Compare BGZF codecs by running the same scbamsplit binary against two htslib builds,
+# one with zlib and one configured with --with-libdeflate:
+#
+#   scripts/bench_codec.sh input.bam metadata.csv /path/to/zlib-htslib/lib /path/to/libdeflate-htslib/lib [threads]
+#
+# Two runs are timed for each codec:
+#   inflate - metadata matching no cell, so only the input is decompressed
+#   split   - the given metadata, so the input is decompressed and every output compressed
+# Extra scbamsplit options (e.g., -p 10Xv3 or --level 6) can be passed in SCBAMSPLIT_OPTS.
+
+set -euo pipefail
+
+if [ "$#" -lt 4 ]; then
+    sed -n '5,13p' "$0" | sed 's/^# \{0,1\}//'
+    exit 1
+fi
+
+bam=$1
+meta=$2
+zlib_lib=$3
+deflate_lib=$4
+threads=${5:-1}
+bin=${SCBAMSPLIT:-scbamsplit}
+opts=${SCBAMSPLIT_OPTS:-}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# A cell barcode no read carries
+printf 'barcode,label\nNNNNNNNNNNNNNNNN,none\n' > "$work/none.csv"
+
+run() {
+    # run <codec> <libdir> <mode> <metadata>
+    # scbamsplit creates the output directory (an existing one would make it ask before overwriting)
+    local out="$work/$1_$3/"
+    local start end
+    start=$(date +%s.%N)
+    # shellcheck disable=SC2086
+    LD_LIBRARY_PATH="$2${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}" \
+        "$bin" -f "$bam" -m "$4" -o "$out" -@ "$threads" -v 3 $opts 2> "$work/$1_$3.log"
+    end=$(date +%s.%N)
+    local codec
+    codec=$(grep -o 'BGZF codec: [a-z]*' "$work/$1_$3.log" | cut -d' ' -f3 || true)
+    local size
+    size=$(du -sk "$out" | cut -f1)
+    printf '%-10s %-8s %-12s %10.2f %12s\n' "$1" "$3" "${codec:-?}" "$(echo "$end - $start" | bc)" "$size"
+    rm -rf "$out"
+}
+
+printf '%-10s %-8s %-12s %10s %12s\n' "htslib" "run" "codec" "seconds" "output (KB)"
+for mode in inflate split; do
+    if [ "$mode" = inflate ]; then m="$work/none.csv"; else m=$meta; fi
+    run zlib "$zlib_lib" "$mode" "$m"
+    run libdeflate "$deflate_lib" "$mode" "$m"
+done
@@ -0,0 +1,70 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+// Every allocation is aligned for any member type (pointers, 64-bit integers)
+#define ARENA_ALIGN 16
+#define ARENA_HDR ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    /**
+     * @abstract Allocate zeroed memory that lives until the arena is destroyed.
+     * @returns The memory; NULL on allocation failure
+     */
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    arena_block_t *block = arena->head;
+    if (NULL == block || block->cap - block->used < size) {
+        size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(ARENA_HDR + cap);
+        if (NULL == block) return NULL;
+        block->used = 0;
+        block->cap = cap;
+        if (size > ARENA_BLOCK_SIZE && NULL != arena->head) {
+            // Keep filling the current block after an oversized allocation
+            block->next = arena->head->next;
+            arena->head->next = block;
+        } else {
+            block->next = arena->head;
+            arena->head = block;
+        }
+        arena->bytes += ARENA_HDR + cap;
+    }
+    void *p = (char *) block + ARENA_HDR + block->used;
+    block->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+void arena_absorb(arena_t *arena, arena_t *from) {
+    /**
+     * @abstract Move all memory of another arena into this one (e.g., arenas filled by threads),
+     * leaving the other one empty.
+     */
+    if (NULL == from->head) return;
+    arena_block_t *last = from->head;
+    while (NULL != last->next) last = last->next;
+    if (NULL == arena->head) {
+        arena->head = from->head;
+    } else {
+        // The current block stays first so it keeps being filled
+        last->next = arena->head->next;
+        arena->head->next = from->head;
+    }
+    arena->bytes += from->bytes;
+    from->head = NULL;
+    from->bytes = 0;
+}
+
+void arena_destroy(arena_t *arena) {
+    arena_block_t *block = arena->head;
+    while (NULL != block) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->bytes = 0;
+}
@@ -0,0 +1,30 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+
+#ifndef SCBAMSPLIT_ARENA_H
+#define SCBAMSPLIT_ARENA_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Allocations are carved out of blocks of this size (larger ones get a block of their own)
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t cap;
+} arena_block_t;
+
+// A bump allocator for many small objects that are freed together: there is no per-object free,
+// and arena_destroy() releases everything in one go. A zeroed arena_t is an empty arena.
+typedef struct {
+    arena_block_t *head;       /* block being filled; earlier blocks follow through next */
+    size_t bytes;              /* total size of all blocks */
+} arena_t;
+
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_absorb(arena_t *arena, arena_t *from);
+void arena_destroy(arena_t *arena);
+
+#endif //SCBAMSPLIT_ARENA_H
@@ -0,0 +1,647 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bctable.h"
+#include "utils.h"
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BC_PACK_X86
+#include <immintrin.h>
+#include <inttypes.h>
+#endif
+
+// Packing the bases of a barcode: validates ACGT and packs them in the same pass. Kernels take
+// at most BC_MAX_BASES characters of s and return the number of leading ACGT bases, packed in key.
+typedef int32_t (*pack_bases_fn)(const char *s, int32_t len, uint64_t *key);
+
+static int32_t pack_bases_scalar(const char *s, int32_t len, uint64_t *key) {
+    int32_t n_bases = 0;
+    uint64_t packed = 0;
+    if (len > BC_MAX_BASES) len = BC_MAX_BASES;
+    for (; n_bases < len; n_bases++) {
+        char c = s[n_bases];
+        if (c != 'A' && c != 'C' && c != 'G' && c != 'T') break;
+        packed |= (uint64_t) ((c >> 1) & 3) << (2 * n_bases);
+    }
+    *key = packed;
+    return n_bases;
+}
+
+#ifdef BC_PACK_X86
+static inline uint64_t spread_bits(uint32_t x) {
+    // Move bit i to bit 2i
+    uint64_t v = x;
+    v = (v | v << 16) & 0x0000ffff0000ffffULL;
+    v = (v | v << 8) & 0x00ff00ff00ff00ffULL;
+    v = (v | v << 4) & 0x0f0f0f0f0f0f0f0fULL;
+    v = (v | v << 2) & 0x3333333333333333ULL;
+    return (v | v << 1) & 0x5555555555555555ULL;
+}
+
+static inline uint64_t pack_masks(uint32_t acgt, uint32_t bit1, uint32_t bit2, int32_t len, int32_t *n_bases) {
+    // Combine per-byte masks (ACGT or not, and bits 1 and 2 of each byte, i.e., the 2-bit code)
+    // into the packed key of the leading ACGT bases
+    uint32_t in_range = len >= 32 ? ~0u : (1u << len) - 1;
+    uint32_t invalid = ~acgt & in_range;
+    *n_bases = 0 != invalid ? __builtin_ctz(invalid) : (len < 32 ? len : 32);
+    uint32_t keep = *n_bases >= 32 ? ~0u : (1u << *n_bases) - 1;
+    return spread_bits(bit1 & keep) | spread_bits(bit2 & keep) << 1;
+}
+
+static inline const char *load_window(const char *s, int32_t len, char *buf) {
+    // Reading 32 bytes from s is only safe without crossing into the next page; short barcodes
+    // near the end of a page are copied first
+    if (len >= 32 || ((uintptr_t) s & 4095) <= 4096 - 32) return s;
+    memcpy(buf, s, len);
+    return buf;
+}
+
+__attribute__((target("sse2")))
+static int32_t pack_bases_sse2(const char *s, int32_t len, uint64_t *key) {
+    char buf[32];
+    const char *w = load_window(s, len, buf);
+    uint32_t acgt = 0, bit1 = 0, bit2 = 0;
+    for (int32_t half = 0; half < 2; half++) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (w + 16 * half));
+        __m128i is_acgt = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('A')), _mm_cmpeq_epi8(v, _mm_set1_epi8('C'))),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('G')), _mm_cmpeq_epi8(v, _mm_set1_epi8('T'))));
+        acgt |= (uint32_t) _mm_movemask_epi8(is_acgt) << (16 * half);
+        // Shifting 16-bit lanes never moves a bit into the top bit of another byte
+        bit1 |= (uint32_t) _mm_movemask_epi8(_mm_slli_epi16(v, 6)) << (16 * half);
+        bit2 |= (uint32_t) _mm_movemask_epi8(_mm_slli_epi16(v, 5)) << (16 * half);
+        if (len <= 16) break;
+    }
+    int32_t n_bases;
+    *key = pack_masks(acgt, bit1, bit2, len, &n_bases);
+    return n_bases;
+}
+
+__attribute__((target("avx2")))
+static int32_t pack_bases_avx2(const char *s, int32_t len, uint64_t *key) {
+    char buf[32];
+    const char *w = load_window(s, len, buf);
+    __m256i v = _mm256_loadu_si256((const __m256i *) w);
+    __m256i is_acgt = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('A')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('C'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('G')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('T'))));
+    int32_t n_bases;
+    *key = pack_masks((uint32_t) _mm256_movemask_epi8(is_acgt),
+                      (uint32_t) _mm256_movemask_epi8(_mm256_slli_epi16(v, 6)),
+                      (uint32_t) _mm256_movemask_epi8(_mm256_slli_epi16(v, 5)), len, &n_bases);
+    return n_bases;
+}
+#endif
+
+static pack_bases_fn pack_bases = pack_bases_scalar;
+
+const char *bc_pack_init(void) {
+    /**
+     * @abstract Pick the packing kernel for this CPU; call once at startup, before any thread is
+     * started. The scalar kernel is used until then.
+     * @returns The name of the kernel
+     */
+#ifdef BC_PACK_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        pack_bases = pack_bases_avx2;
+        return "AVX2";
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        pack_bases = pack_bases_sse2;
+        return "SSE2";
+    }
+#endif
+    pack_bases = pack_bases_scalar;
+    return "scalar";
+}
+
+int8_t bc_pack(const char *s, int32_t len, bc_entry_t *entry) {
+    /**
+     * @abstract Pack a barcode into a 2-bit key.
+     * @s, len The barcode (not necessarily NUL-terminated)
+     * @entry Returns the key, number of bases and suffix; val is left untouched
+     * @returns 0 on success; -1 if the barcode has to be looked up as a string
+     */
+    if (len <= 0) return -1;
+    uint64_t key;
+    int32_t n_bases = pack_bases(s, len, &key);
+    // Bases end with the barcode or at a suffix; anything else (N, more than 32 bases) is not packed
+    if (0 == n_bases || (n_bases < len && s[n_bases] != '-')) return -1;
+
+    // Only suffixes that print back the same way ("-1", not "-01") can be packed
+    uint32_t suffix = 0;
+    if (n_bases < len) {
+        int32_t n_digits = len - n_bases - 1;
+        const char *d = s + n_bases + 1;
+        if (n_digits < 1 || n_digits > 5 || (d[0] == '0' && n_digits > 1)) return -1;
+        for (int32_t i = 0; i < n_digits; i++) {
+            if (d[i] < '0' || d[i] > '9') return -1;
+            suffix = suffix * 10 + (d[i] - '0');
+        }
+        if (suffix >= UINT16_MAX) return -1;
+        suffix++;
+    }
+
+    entry->key = key;
+    entry->len = (uint16_t) n_bases;
+    entry->suffix = (uint16_t) suffix;
+    return 0;
+}
+
+static inline uint64_t bc_fingerprint(const bc_entry_t *e) {
+    // The key mixed with its length and suffix
+    return e->key ^ (((uint64_t) e->suffix << 16 | e->len) * 0xff51afd7ed558ccdULL);
+}
+
+static inline uint64_t bc_slot(const bctable_t *bct, const bc_entry_t *e) {
+    // Multiply-shift hashing
+    return (bc_fingerprint(e) * 0x9e3779b97f4a7c15ULL) >> bct->shift;
+}
+
+
+static int8_t slots_init(bctable_t *bct, uint64_t n_keys) {
+    // Keep the table at most half full
+    uint8_t bits = 4;
+    while (((uint64_t) 1 << bits) < 2 * n_keys) bits++;
+    bct->mask = ((uint64_t) 1 << bits) - 1;
+    bct->shift = 64 - bits;
+    bct->slots = calloc(bct->mask + 1, sizeof(bc_entry_t));
+    return NULL == bct->slots ? 1 : 0;
+}
+
+static bool slot_put(bctable_t *bct, const bc_entry_t *e) {
+    // Insert or overwrite an entry; returns true if the key is new
+    uint64_t i = bc_slot(bct, e);
+    while (0 != bct->slots[i].len && !bc_same(&bct->slots[i], e)) i = (i + 1) & bct->mask;
+    bool is_new = 0 == bct->slots[i].len;
+    bct->slots[i] = *e;
+    return is_new;
+}
+
+static void build_mphf(bctable_t *bct) {
+    // Move the packed keys from the probing table to MPHF order; keys the MPHF cannot
+    // place stay in a (much smaller) probing table
+    uint64_t n_keys = bct->n_keys;
+    bc_entry_t *entries = malloc(n_keys * sizeof(bc_entry_t));
+    uint64_t *fps = malloc(n_keys * sizeof(uint64_t));
+    if (NULL == entries || NULL == fps) goto keep_probing;
+
+    uint64_t n = 0;
+    for (uint64_t i = 0; i <= bct->mask; i++) {
+        if (0 == bct->slots[i].len) continue;
+        entries[n] = bct->slots[i];
+        fps[n++] = bc_fingerprint(&bct->slots[i]);
+    }
+    bct->mphf = mphf_build(fps, n_keys, 2.0, MAX_THREADS);
+    if (NULL == bct->mphf) goto keep_probing;
+    bct->verify = malloc((bct->mphf->n_placed > 0 ? bct->mphf->n_placed : 1) * sizeof(bc_entry_t));
+    if (NULL == bct->verify) {
+        mphf_destroy(bct->mphf);
+        bct->mphf = NULL;
+        goto keep_probing;
+    }
+
+    bc_entry_t *probing = bct->slots;
+    uint64_t mask = bct->mask;
+    uint8_t shift = bct->shift;
+    if (0 != slots_init(bct, n_keys - bct->mphf->n_placed)) {
+        bct->slots = probing;
+        bct->mask = mask;
+        bct->shift = shift;
+        mphf_destroy(bct->mphf);
+        bct->mphf = NULL;
+        free(bct->verify);
+        bct->verify = NULL;
+        goto keep_probing;
+    }
+    if (NULL != bct->map) {
+        munmap(bct->map, bct->map_len);
+        bct->map = NULL;
+    } else {
+        free(probing);
+    }
+    for (uint64_t i = 0; i < n_keys; i++) {
+        int64_t idx = mphf_lookup(bct->mphf, fps[i]);
+        if (idx >= 0) {
+            bct->verify[idx] = entries[i];
+        } else {
+            slot_put(bct, &entries[i]);
+        }
+    }
+    log_msg("Minimal perfect hash over %" PRIu64 " barcodes (%" PRIu64 " bits, %" PRIu64
+            " left to the probing table)", DEBUG,
+            bct->mphf->n_placed, bct->mphf->level_off[bct->mphf->n_levels], n_keys - bct->mphf->n_placed);
+    free(entries);
+    free(fps);
+    return;
+
+    keep_probing:
+    log_msg("Fail to build the minimal perfect hash; using the regular barcode table", WARNING);
+    free(entries);
+    free(fps);
+}
+
+static inline uint64_t bloom_hash(uint64_t fp) {
+    uint64_t h = (fp ^ (fp >> 31)) * 0x7fb5d329728ea185ULL;
+    h = (h ^ (h >> 27)) * 0x81dadef4bc2dd44dULL;
+    return h ^ (h >> 33);
+}
+
+static inline bool bloom_check(const bctable_t *bct, uint64_t fp, bool set) {
+    // The top bits pick a block and 9-bit slices of the rest pick bits within it
+    uint64_t h = bloom_hash(fp);
+    uint64_t *block = bct->bloom + (bct->bloom_shift < 64 ? (h >> bct->bloom_shift) * 8 : 0);
+    uint64_t missing = 0;
+    for (int8_t i = 0; i < BC_BLOOM_K; i++) {
+        uint32_t bit = (uint32_t) (h >> (9 * i)) & 511;
+        uint64_t mask = (uint64_t) 1 << (bit & 63);
+        if (set) block[bit >> 6] |= mask;
+        missing |= mask & ~block[bit >> 6];
+    }
+    return 0 == missing;
+}
+
+static void build_bloom(bctable_t *bct) {
+    // About 16 bits per key, which keeps false positives well under 1% with 6 bits per key
+    uint8_t block_bits = 0;
+    while (((uint64_t) 512 << block_bits) < bct->n_keys * 16) block_bits++;
+    bct->bloom_shift = 64 - block_bits;
+    bct->bloom = calloc((uint64_t) 8 << block_bits, sizeof(uint64_t));
+    if (NULL == bct->bloom) {
+        log_msg("Fail to allocate the barcode prefilter; continue without it", WARNING);
+        return;
+    }
+    for (uint64_t i = 0; i <= bct->mask; i++) {
+        if (0 != bct->slots[i].len) bloom_check(bct, bc_fingerprint(&bct->slots[i]), true);
+    }
+    log_msg("Barcode prefilter of %" PRIu64 " KB", DEBUG, ((uint64_t) 64 << block_bits) >> 10);
+}
+
+bctable_t *bctable_build(rt_store_t *store, bool use_mphf, bool use_bloom) {
+    /**
+     * @abstract Build the barcode lookup table from the metadata hash table.
+     * @store The parsed metadata, which is destroyed once the table is built: packed barcodes
+     * only keep their slot, and the rest are copied into the arena of the table
+     * @use_mphf Look packed barcodes up through a minimal perfect hash, which takes longer to
+     * build (on MAX_THREADS threads) but needs one probe and less memory for large whitelists
+     * @use_bloom Reject most packed barcodes that are not in the table with a Bloom filter
+     * @returns The lookup table; NULL on failure (store is then left untouched)
+     */
+    bctable_t *bct = calloc(1, sizeof(bctable_t));
+    if (NULL == bct) return NULL;
+    if (0 != slots_init(bct, HASH_COUNT(store->r2l))) {
+        log_msg("Fail to allocate the barcode table", ERROR);
+        free(bct);
+        return NULL;
+    }
+
+    uint64_t n_str = 0;
+    for (rt2label *s = store->r2l; s != NULL; s = s->hh.next) {
+        bc_entry_t e;
+        size_t len = strlen(s->rt);
+        if (0 == bc_pack(s->rt, (int32_t) len, &e)) {
+            // The 16-byte slot is all that is kept of a packed barcode
+            e.val = s->lid;
+            if (slot_put(bct, &e)) bct->n_keys++;
+            continue;
+        }
+        rt2label *copy = new_rt2label(&bct->arena, s->rt, len, s->lid);
+        if (NULL == copy) {
+            log_msg("Fail to allocate the barcode table", ERROR);
+            bctable_destroy(bct);
+            return NULL;
+        }
+        HASH_ADD_BYHASHVALUE(hh, bct->r2l, rt, (unsigned) len, s->hh.hashv, copy);
+        n_str++;
+    }
+    log_msg("%" PRIu64 " barcodes packed into 2-bit keys, %" PRIu64 " kept as strings (%" PRIu64
+            " KB of parsed metadata freed)", DEBUG,
+            bct->n_keys, n_str, store->arena.bytes >> 10);
+    destroy_rt_store(store);
+
+    if (use_bloom && bct->n_keys > 0) build_bloom(bct);
+    if (use_mphf && bct->n_keys > 0) build_mphf(bct);
+    return bct;
+}
+
+bool is_compiled_meta(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (NULL == fp) return false;
+    char magic[8];
+    bool compiled = fread(magic, 1, 8, fp) == 8 && memcmp(magic, META_BIN_MAGIC, 8) == 0;
+    fclose(fp);
+    return compiled;
+}
+
+int8_t bctable_save(bctable_t *bct, label_set_t *labels, const char *path) {
+    /**
+     * @abstract Write the barcode table and labels to a file that bctable_load() maps back
+     * without parsing.
+     * @bct A table built without a minimal perfect hash
+     * @returns 0 on success; 1 on failure
+     */
+    meta_bin_hdr_t hdr = {0};
+    memcpy(hdr.magic, META_BIN_MAGIC, 8);
+    hdr.version = META_BIN_VERSION;
+    hdr.byte_order = 0x01020304;
+    hdr.n_slots = bct->mask + 1;
+    hdr.n_keys = bct->n_keys;
+    hdr.n_labels = labels->n;
+    hdr.n_strkeys = HASH_COUNT(bct->r2l);
+    for (uint32_t lid = 0; lid < labels->n; lid++) hdr.label_bytes += strlen(labels->by_id[lid]->label) + 1;
+    for (rt2label *s = bct->r2l; s != NULL; s = s->hh.next) hdr.strkey_bytes += sizeof(uint32_t) + strlen(s->rt) + 1;
+    hdr.n_group_words = labels->n_group_words;
+
+    FILE *fp = fopen(path, "wb");
+    if (NULL == fp) {
+        log_msg("Cannot create file (%s)", ERROR, path);
+        return 1;
+    }
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+              fwrite(bct->slots, sizeof(bc_entry_t), hdr.n_slots, fp) == hdr.n_slots;
+    for (uint32_t lid = 0; ok && lid < labels->n; lid++) {
+        const char *label = labels->by_id[lid]->label;
+        ok = fwrite(label, 1, strlen(label) + 1, fp) == strlen(label) + 1;
+    }
+    if (ok && hdr.n_group_words > 0) {
+        ok = fwrite(labels->groups, sizeof(uint32_t), hdr.n_group_words, fp) == hdr.n_group_words;
+    }
+    for (rt2label *s = bct->r2l; ok && s != NULL; s = s->hh.next) {
+        ok = fwrite(&s->lid, sizeof(uint32_t), 1, fp) == 1 && fwrite(s->rt, 1, strlen(s->rt) + 1, fp) == strlen(s->rt) + 1;
+    }
+    if (0 != fclose(fp) || !ok) {
+        log_msg("Fail to write compiled metadata (%s)", ERROR, path);
+        return 1;
+    }
+    return 0;
+}
+
+int8_t compile_meta(const char *metapath, const char *outpath) {
+    /**
+     * @abstract Parse a metadata table once and save it as compiled metadata, which later runs
+     * can take as -m and map instead of parsing.
+     * @returns 0 on success; 1 on failure
+     */
+    label_set_t labels = {0};
+    rt_store_t store = {NULL};
+    if (0 != hash_readtag((char *) metapath, &labels, &store)) {
+        log_msg("Failed to hash the metadata.", ERROR);
+        destroy_labels(&labels);
+        return 1;
+    }
+    bctable_t *bct = bctable_build(&store, false, false);
+    if (NULL == bct) destroy_rt_store(&store);
+    int8_t return_val = NULL == bct ? 1 : bctable_save(bct, &labels, outpath);
+    if (0 == return_val) {
+        log_msg("Compiled %" PRIu64 " packed barcodes, %u other barcodes and %u labels into %s", INFO,
+                bct->n_keys, HASH_COUNT(bct->r2l), labels.n, outpath);
+    }
+    bctable_destroy(bct);
+    destroy_labels(&labels);
+    return return_val;
+}
+
+static bool label_value_ok(const label_set_t *labels, uint32_t val) {
+    // Check that a label value read from a file only leads to existing labels
+    if (!(val & LABEL_GROUP)) return val < labels->n;
+    uint32_t off = val & ~LABEL_GROUP;
+    if (off >= labels->n_group_words || labels->groups[off] > labels->n_group_words - off - 1) return false;
+    const uint32_t *lids;
+    uint32_t n = label_ids(labels, &val, &lids);
+    for (uint32_t i = 0; i < n; i++) {
+        if (lids[i] >= labels->n) return false;
+    }
+    return true;
+}
+
+bctable_t *bctable_load(const char *path, label_set_t *labels, bool use_mphf, bool use_bloom) {
+    /**
+     * @abstract Map a compiled metadata file: the probing table is used in place, and only labels
+     * and barcodes that cannot be packed are copied.
+     * @labels An empty label set to fill (IDs are kept as compiled)
+     * @use_mphf, use_bloom As in bctable_build()
+     * @returns The lookup table; NULL on failure
+     */
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_msg("Cannot open file (%s)", ERROR, path);
+        return NULL;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (0 == fstat(fd, &st) && st.st_size >= (off_t) sizeof(meta_bin_hdr_t)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (MAP_FAILED == map) {
+        log_msg("Fail to map compiled metadata (%s)", ERROR, path);
+        return NULL;
+    }
+
+    meta_bin_hdr_t *hdr = (meta_bin_hdr_t *) map;
+    uint64_t slot_bytes = hdr->n_slots * sizeof(bc_entry_t);
+    if (hdr->version != META_BIN_VERSION || hdr->byte_order != 0x01020304 ||
+        0 == hdr->n_slots || (hdr->n_slots & (hdr->n_slots - 1)) != 0 ||
+        hdr->n_group_words >= LABEL_GROUP || sizeof(meta_bin_hdr_t) + slot_bytes + hdr->label_bytes +
+        hdr->n_group_words * sizeof(uint32_t) + hdr->strkey_bytes != (uint64_t) st.st_size) {
+        log_msg("%s is not a compiled metadata file of this version; please compile it again", ERROR, path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    bctable_t *bct = calloc(1, sizeof(bctable_t));
+    if (NULL == bct) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    bct->map = map;
+    bct->map_len = st.st_size;
+    bct->slots = (bc_entry_t *) ((char *) map + sizeof(meta_bin_hdr_t));
+    bct->mask = hdr->n_slots - 1;
+    bct->shift = 64 - __builtin_ctzll(hdr->n_slots);
+    bct->n_keys = hdr->n_keys;
+
+    const char *p = (const char *) bct->slots + slot_bytes;
+    const char *end = p + hdr->label_bytes;
+    for (uint64_t lid = 0; lid < hdr->n_labels; lid++) {
+        size_t len = strnlen(p, end - p);
+        if (len == (size_t) (end - p) || intern_label(labels, p, len) != (int64_t) lid) {
+            log_msg("Malformed labels in compiled metadata (%s)", ERROR, path);
+            bctable_destroy(bct);
+            return NULL;
+        }
+        p += len + 1;
+    }
+    if (hdr->n_group_words > 0) {
+        labels->groups = malloc(hdr->n_group_words * sizeof(uint32_t));
+        if (NULL == labels->groups) {
+            bctable_destroy(bct);
+            return NULL;
+        }
+        memcpy(labels->groups, p, hdr->n_group_words * sizeof(uint32_t));
+        labels->n_group_words = labels->group_cap = hdr->n_group_words;
+        p += hdr->n_group_words * sizeof(uint32_t);
+        // Every group has to hold valid label IDs
+        for (uint32_t off = 0; off < labels->n_group_words; off += labels->groups[off] + 1) {
+            if (!label_value_ok(labels, LABEL_GROUP | off)) {
+                log_msg("Malformed label groups in compiled metadata (%s)", ERROR, path);
+                bctable_destroy(bct);
+                return NULL;
+            }
+        }
+    }
+    end = p + hdr->strkey_bytes;
+    for (uint64_t i = 0; i < hdr->n_strkeys; i++) {
+        size_t len = end - p > 4 ? strnlen(p + 4, end - p - 4) : 0;
+        if (end - p <= 4 || len == (size_t) (end - p - 4)) {
+            log_msg("Malformed barcodes in compiled metadata (%s)", ERROR, path);
+            bctable_destroy(bct);
+            return NULL;
+        }
+        rt2label *s = new_rt2label(&bct->arena, p + 4, len, 0);
+        if (NULL == s) {
+            bctable_destroy(bct);
+            return NULL;
+        }
+        memcpy(&s->lid, p, sizeof(uint32_t));
+        if (!label_value_ok(labels, s->lid)) {
+            log_msg("Malformed barcodes in compiled metadata (%s)", ERROR, path);
+            bctable_destroy(bct);
+            return NULL;
+        }
+        HASH_ADD_STR(bct->r2l, rt, s);
+        p += 4 + len + 1;
+    }
+    // Slots are used in place, so lookups (and the MPHF built from them) rely on every occupied
+    // slot being a valid barcode, their count being n_keys, and at least one slot being empty
+    uint64_t n_occupied = 0;
+    for (uint64_t i = 0; i < hdr->n_slots; i++) {
+        const bc_entry_t *e = &bct->slots[i];
+        if (0 == e->len) continue;
+        n_occupied++;
+        if (e->len > BC_MAX_BASES || !label_value_ok(labels, e->val)) {
+            n_occupied = UINT64_MAX;
+            break;
+        }
+    }
+    if (n_occupied != hdr->n_keys || n_occupied >= hdr->n_slots) {
+        log_msg("Malformed barcode table in compiled metadata (%s)", ERROR, path);
+        bctable_destroy(bct);
+        return NULL;
+    }
+    log_msg("Mapped %" PRIu64 " packed barcodes and %" PRIu64 " labels from compiled metadata", DEBUG,
+            bct->n_keys, hdr->n_labels);
+
+    if (use_bloom && bct->n_keys > 0) build_bloom(bct);
+    if (use_mphf && bct->n_keys > 0) build_mphf(bct);
+    return bct;
+}
+
+static int64_t find_packed(bctable_t *bct, const bc_entry_t *e) {
+    if (NULL != bct->bloom && !bloom_check(bct, bc_fingerprint(e), false)) return -1;
+    if (NULL != bct->mphf) {
+        int64_t idx = mphf_lookup(bct->mphf, bc_fingerprint(e));
+        if (idx >= 0 && bc_same(&bct->verify[idx], e)) return bct->verify[idx].val;
+    }
+    for (uint64_t i = bc_slot(bct, e); 0 != bct->slots[i].len; i = (i + 1) & bct->mask) {
+        if (bc_same(&bct->slots[i], e)) return bct->slots[i].val;
+    }
+    return -1;
+}
+
+int64_t bctable_find(bctable_t *bct, const char *s, int32_t len) {
+    /**
+     * @abstract Look up the label of a barcode.
+     * @s, len The barcode (not necessarily NUL-terminated)
+     * @returns The label ID, or a label group for a barcode in several labels (see label_ids());
+     * -1 if the barcode is not in the metadata
+     */
+    bc_entry_t e;
+    if (0 != bc_pack(s, len, &e)) {
+        rt2label *found = NULL;
+        HASH_FIND(hh, bct->r2l, s, len, found);
+        return NULL == found ? -1 : found->lid;
+    }
+    return find_packed(bct, &e);
+}
+
+int64_t bctable_correct(bctable_t *bct, const char *s, int32_t len, const char *qual, int32_t qual_len,
+                        bool *by_qual) {
+    /**
+     * @abstract Look for a barcode of the table one substitution away from a barcode that is not
+     * in it (a single N counts as the substitution), by probing every substitution of the packed key.
+     * @s, len The barcode (not necessarily NUL-terminated)
+     * @qual, qual_len Base qualities of the barcode (e.g., the CY tag); NULL if not available
+     * @by_qual Set to whether qual decided between neighbors, so the result may differ for another
+     * read with the same barcode; may be NULL
+     * @returns As bctable_find() for the only neighbor found, or for the neighbor at the base with
+     * the lowest quality when there are several with different labels; -1 if none or ambiguous
+     */
+    int32_t n_bases = 0, n_pos = -1;
+    char bases[BC_MAX_BASES + 8];
+    if (NULL != by_qual) *by_qual = false;
+    for (; n_bases < len && s[n_bases] != '-'; n_bases++) {
+        char c = s[n_bases];
+        if (n_bases == BC_MAX_BASES) return -1;
+        if (c != 'A' && c != 'C' && c != 'G' && c != 'T') {
+            if (n_pos >= 0) return -1;
+            n_pos = n_bases;
+            c = 'A';
+        }
+        bases[n_bases] = c;
+    }
+    if (len - n_bases > (int32_t) sizeof(bases) - n_bases) return -1;
+    memcpy(bases + n_bases, s + n_bases, len - n_bases);
+    bc_entry_t e;
+    if (0 != bc_pack(bases, len, &e)) return -1;
+    if (NULL == qual || qual_len < n_bases) qual = NULL;
+
+    int64_t hits[4 * BC_MAX_BASES];
+    int32_t hit_qual[4 * BC_MAX_BASES];
+    int32_t n_hits = 0;
+    for (int32_t i = n_pos >= 0 ? n_pos : 0; i < (n_pos >= 0 ? n_pos + 1 : n_bases); i++) {
+        uint64_t code = (e.key >> (2 * i)) & 3;
+        for (uint64_t sub = 0; sub < 4; sub++) {
+            if (sub == code && n_pos < 0) continue;
+            bc_entry_t neighbor = e;
+            neighbor.key ^= (code ^ sub) << (2 * i);
+            int64_t val = find_packed(bct, &neighbor);
+            if (val < 0) continue;
+            hits[n_hits] = val;
+            hit_qual[n_hits++] = NULL == qual ? 0 : (int32_t) (uint8_t) qual[i];
+        }
+    }
+
+    // Neighbors with the same label are as good as one
+    int32_t best = -1;
+    for (int32_t i = 0; i < n_hits; i++) {
+        if (best < 0 || hit_qual[i] < hit_qual[best]) best = i;
+    }
+    for (int32_t i = 0; i < n_hits; i++) {
+        if (hits[i] == hits[best]) continue;
+        if (NULL != by_qual) *by_qual = true;
+        if (hit_qual[i] == hit_qual[best]) return -1;
+    }
+    return best < 0 ? -1 : hits[best];
+}
+
+void bctable_destroy(bctable_t *bct) {
+    if (NULL == bct) return;
+    HASH_CLEAR(hh, bct->r2l);
+    arena_destroy(&bct->arena);
+    if (NULL != bct->map) {
+        munmap(bct->map, bct->map_len);
+    } else {
+        free(bct->slots);
+    }
+    mphf_destroy(bct->mphf);
+    free(bct->verify);
+    free(bct->bloom);
+    free(bct);
+}
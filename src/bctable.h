@@ -0,0 +1,86 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+
+#ifndef SCBAMSPLIT_BCTABLE_H
+#define SCBAMSPLIT_BCTABLE_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "hash.h"
+#include "mphf.h"
+
+// Longest barcode (in bases) that fits in a packed key
+#define BC_MAX_BASES 32
+// Bits set per key in the Bloom filter
+#define BC_BLOOM_K 6
+
+// A barcode of up to 32 ACGT bases packed 2 bits per base, with an optional numeric
+// suffix such as 10x Genomics' "-1"
+typedef struct {
+    uint64_t key;    // Base i in bits 2i and 2i+1, as (c >> 1) & 3 (A=0, C=1, T=2, G=3)
+    uint32_t val;    // Label ID or label group (see label_ids())
+    uint16_t len;    // Number of bases; 0 marks an empty slot
+    uint16_t suffix; // n + 1 for a "-n" suffix; 0 for no suffix
+} bc_entry_t;
+
+// Barcode-to-label-ID lookup: packable barcodes go to an open-addressing table, and
+// anything else stays in the string hash table it was built from
+typedef struct {
+    bc_entry_t *slots;
+    uint64_t mask;
+    uint8_t shift;
+    uint64_t n_keys;
+    // With a minimal perfect hash, packed keys are stored in verify at their MPHF index, and
+    // slots only holds keys the MPHF could not place
+    mphf_t *mphf;
+    bc_entry_t *verify;
+    // Blocked Bloom filter over packed keys, checked before any of the above: every key sets
+    // BC_BLOOM_K bits within one 512-bit block (a cache line)
+    uint64_t *bloom;
+    uint8_t bloom_shift;
+    rt2label *r2l;
+    arena_t arena;             /* memory of the entries of r2l */
+    // Whether cell barcodes not found are corrected to a neighbor (see bctable_correct())
+    bool correct;
+    // Set when slots is mapped from a compiled metadata file rather than allocated
+    void *map;
+    size_t map_len;
+} bctable_t;
+
+#define META_BIN_MAGIC "SCBSMETA"
+#define META_BIN_VERSION 2
+
+// Header of a compiled metadata file (scbamsplit compile-meta), followed by the slots of the
+// probing table, the labels in ID order, label groups (label_set_t.groups), and barcodes that
+// cannot be packed, each as a uint32_t label value and the NUL-terminated barcode. Numbers are
+// in the byte order of the host that wrote the file.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;       // 0x01020304 as written
+    uint64_t n_slots;
+    uint64_t n_keys;
+    uint64_t n_labels;
+    uint64_t n_strkeys;
+    uint64_t label_bytes;
+    uint64_t strkey_bytes;
+    uint64_t n_group_words;
+} meta_bin_hdr_t;
+
+static inline bool bc_same(const bc_entry_t *a, const bc_entry_t *b) {
+    return a->key == b->key && a->len == b->len && a->suffix == b->suffix;
+}
+
+const char *bc_pack_init(void);
+int8_t bc_pack(const char *s, int32_t len, bc_entry_t *entry);
+bctable_t *bctable_build(rt_store_t *store, bool use_mphf, bool use_bloom);
+bool is_compiled_meta(const char *path);
+int8_t compile_meta(const char *metapath, const char *outpath);
+int8_t bctable_save(bctable_t *bct, label_set_t *labels, const char *path);
+bctable_t *bctable_load(const char *path, label_set_t *labels, bool use_mphf, bool use_bloom);
+int64_t bctable_find(bctable_t *bct, const char *s, int32_t len);
+int64_t bctable_correct(bctable_t *bct, const char *s, int32_t len, const char *qual, int32_t qual_len,
+                        bool *by_qual);
+void bctable_destroy(bctable_t *bct);
+
+#endif //SCBAMSPLIT_BCTABLE_H
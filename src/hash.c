@@ -6,129 +6,467 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "htslib/bgzf.h"
+#include "thread_pool.h"
 #include "utils.h"
-rt2label* hash_readtag(char *path) {
-    // Open meta data file
-    FILE* meta_fp = fopen(path, "r");
+#include "spill.h"
+// Metadata smaller than this is not worth handing to threads
+#define META_MIN_PART (1 << 20)
 
-    if (meta_fp == NULL) {
-        // Exit and print error message if the file does not exist
-        log_msg("Cannot open file (%s)", ERROR, path);
-        return NULL;
-    }
+// Rows parsed from one newline-aligned range of the metadata
+typedef struct {
+    const char *beg;
+    const char *end;
+    char sep;
+    rt2label **rows;           /* entries in file order; lid is an ID in the local label set */
+    uint64_t n_rows;
+    uint64_t cap;
+    arena_t arena;             /* memory of the entries */
+    label_set_t labels;        /* labels in order of first appearance within the range */
+    const char *err;           /* start of the first malformed line */
+    uint32_t n_fields;         /* number of fields found on that line */
+} meta_part_t;
 
-    // Declare a read-tag-to-label hash table
-    rt2label *r2l = NULL;
+typedef struct {
+    meta_part_t *part;
+} meta_arg_t;
 
-    // Read every line
-    char meta_line[MAX_LINE_LENGTH]; // Temporary variable to store each line
-    bool first_line = true;
-    char* tokens; // Temporary variable for iterating tokens
-    uint32_t field_num = 0; // Counting numbers to examine if expected field numbers are present
-    char trt[MAX_LINE_LENGTH]; // Temporary variable for read tag content
-    char tlabel[MAX_LINE_LENGTH]; // Temporary variable for corresponding label content
+static char *meta_text(const char *path, size_t *len, bool *mapped) {
+    /**
+     * @abstract Get the whole text of a metadata table: plain files are mapped, and gzip/BGZF
+     * files are decompressed into memory (with the htslib pool for BGZF).
+     * @len Returns the length of the text
+     * @mapped Returns whether the text has to be unmapped instead of freed
+     * @returns The text (not NUL-terminated); NULL on failure
+     */
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    unsigned char magic[2] = {0};
+    struct stat st;
+    if (2 != read(fd, magic, 2) || 0x1f != magic[0] || 0x8b != magic[1]) {
+        char *text = NULL;
+        if (0 == fstat(fd, &st)) {
+            *len = st.st_size;
+            *mapped = st.st_size > 0;
+            if (*mapped) {
+                text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (MAP_FAILED == text) {
+                    text = NULL;
+                } else {
+                    madvise(text, st.st_size, MADV_WILLNEED);
+                }
+            } else {
+                text = malloc(1);
+            }
+        }
+        close(fd);
+        return text;
+    }
+    close(fd);
 
-    while (fgets(meta_line, MAX_LINE_LENGTH, meta_fp) != NULL) {
-        // Assuming header and skip it
-        if (first_line) {
-            first_line = false;
+    BGZF *bgzf = bgzf_open(path, "r");
+    if (NULL == bgzf) return NULL;
+    if (NULL != HTS_POOL.pool) bgzf_thread_pool(bgzf, HTS_POOL.pool, HTS_POOL.qsize);
+    size_t cap = META_MIN_PART;
+    char *text = malloc(cap);
+    ssize_t n_read;
+    *len = 0;
+    *mapped = false;
+    while (NULL != text && (n_read = bgzf_read(bgzf, text + *len, cap - *len)) > 0) {
+        *len += n_read;
+        if (*len == cap) {
+            char *grown = realloc(text, cap *= 2);
+            if (NULL == grown) free(text);
+            text = grown;
+        }
+    }
+    if (NULL != text && n_read < 0) {
+        free(text);
+        text = NULL;
+    }
+    bgzf_close(bgzf);
+    return text;
+}
+
+static void parse_meta_part(void *args_void) {
+    // Split every line of a range into a read tag and a label, stopping at the first malformed line
+    meta_part_t *part = ((meta_arg_t *) args_void)->part;
+    const char *p = part->beg;
+    while (p < part->end) {
+        const char *eol = memchr(p, '\n', part->end - p);
+        if (NULL == eol) eol = part->end;
+        const char *line_end = eol;
+        if (line_end > p && '\r' == line_end[-1]) line_end--;
+        if (line_end == p) {
+            // Blank lines (e.g., at the end of the file) are skipped
+            p = eol + 1;
             continue;
         }
 
+        const char *label = memchr(p, part->sep, line_end - p);
+        part->n_fields = NULL == label ? 1 : 2;
+        if (NULL != label) {
+            for (const char *q = ++label; (q = memchr(q, part->sep, line_end - q)) != NULL; q++) part->n_fields++;
+        }
+        if (2 != part->n_fields || label - 1 == p || label == line_end) {
+            part->err = p;
+            return;
+        }
+
+        if (part->n_rows == part->cap) {
+            uint64_t cap = part->cap > 0 ? part->cap * 2 : 1024;
+            rt2label **rows = realloc(part->rows, cap * sizeof(rt2label *));
+            if (NULL == rows) goto fail;
+            part->rows = rows;
+            part->cap = cap;
+        }
+        int64_t lid = intern_label(&part->labels, label, line_end - label);
+        size_t rt_len = label - 1 - p;
+        rt2label *s = lid < 0 ? NULL : new_rt2label(&part->arena, p, rt_len, (uint32_t) lid);
+        if (NULL == s) goto fail;
+        // Hashed here so the single-threaded merge only links entries in
+        HASH_VALUE(s->rt, rt_len, s->hh.hashv);
+        s->hh.keylen = (unsigned) rt_len;
+        part->rows[part->n_rows++] = s;
+        p = eol + 1;
+    }
+    return;
+
+    fail:
+    part->err = p;
+    part->n_fields = 0;
+}
 
-        // Strip the linebreak
-        meta_line[strcspn(meta_line, "\n")] = 0;
+void destroy_rt_store(rt_store_t *store) {
+    HASH_CLEAR(hh, store->r2l);
+    arena_destroy(&store->arena);
+}
 
-        // Tokenize by comma
-        tokens = strtok(meta_line, ",");
+int8_t hash_readtag(char *path, label_set_t *labels, rt_store_t *store) {
+    /**
+     * @abstract Load a metadata table of read tags and labels, separated by commas or tabs
+     * (as found in the header line), from a plain or gzip/BGZF-compressed file.
+     * The text is split into newline-aligned ranges parsed on up to MAX_THREADS threads.
+     * @labels Label set to add labels to, numbered in order of first appearance
+     * @store Read-tag-to-label table to add to (a zeroed one to start with); barcodes of earlier
+     * metadata found again get the labels of both
+     * @returns 0 on success; 1 on failure or without any row (store is emptied then)
+     */
+    rt2label *r2l = store->r2l;
+    size_t len = 0;
+    bool mapped = false;
+    char *text = meta_text(path, &len, &mapped);
+    if (NULL == text) {
+        // Exit and print error message if the file does not exist
+        log_msg("Cannot open file (%s)", ERROR, path);
+        destroy_rt_store(store);
+        return 1;
+    }
 
-        // Reset field number
-        field_num = 0;
+    // Assuming header and skip it
+    const char *end = text + len;
+    const char *body = memchr(text, '\n', len);
+    body = NULL == body ? end : body + 1;
+    uint64_t n_tabs = 0, n_commas = 0;
+    for (const char *q = text; q < body; q++) {
+        n_tabs += '\t' == *q;
+        n_commas += ',' == *q;
+    }
+    char sep = n_tabs > 0 && 0 == n_commas ? '\t' : ',';
 
-        // Iterate through tokens
-        while (tokens != NULL) {
-            switch(field_num) {
-                case 0:
-                    // Expect the first field to be read tags
-                    strcpy(trt, tokens);
-                    break;
-                case 1:
-                    // Expect the second to be labels
-                    strcpy(tlabel, tokens);
-                    break;
-                default:
-                    log_msg("There are %d fields in the metadata but only 2 are expected",
-                            ERROR, field_num);
-                    return NULL;
+    uint32_t n_parts = (end - body) / META_MIN_PART + 1;
+    if (n_parts > MAX_THREADS) n_parts = MAX_THREADS > 0 ? MAX_THREADS : 1;
+    meta_part_t *parts = calloc(n_parts, sizeof(meta_part_t));
+    if (NULL == parts) goto fail;
+    const char *beg = body;
+    for (uint32_t i = 0; i < n_parts; i++) {
+        const char *cut = i + 1 == n_parts ? end : body + (end - body) / n_parts * (i + 1);
+        if (cut < beg) cut = beg;
+        if (cut < end) {
+            cut = memchr(cut, '\n', end - cut);
+            cut = NULL == cut ? end : cut + 1;
+        }
+        parts[i] = (meta_part_t) {.beg = beg, .end = cut, .sep = sep};
+        beg = cut;
+    }
 
+    if (n_parts > 1) {
+        tpool_t *meta_tp = tpool_create(n_parts, n_parts);
+        for (uint32_t i = 0; i < n_parts; i++) {
+            meta_arg_t args = {&parts[i]};
+            tpool_add_work(meta_tp, parse_meta_part, &args, sizeof(meta_arg_t));
+        }
+        tpool_wait(meta_tp);
+        tpool_destroy(meta_tp);
+    } else {
+        meta_arg_t args = {&parts[0]};
+        parse_meta_part(&args);
+    }
+
+    // Merge ranges in file order, so label IDs are the same as parsing the file in one go
+    uint64_t n_rows = 0, n_multi = 0;
+    for (uint32_t i = 0; i < n_parts; i++) {
+        meta_part_t *part = &parts[i];
+        if (NULL != part->err) {
+            uint64_t line = 2;
+            for (const char *q = body; q < part->err; q++) line += '\n' == *q;
+            if (0 == part->n_fields) {
+                log_msg("Fail to allocate memory for metadata", ERROR);
+            } else if (part->n_fields > 2) {
+                log_msg("There are %u fields on line %" PRIu64 " of the metadata but only 2 are expected",
+                        ERROR, part->n_fields, line);
+            } else {
+                log_msg("There is only %u non-empty field on line %" PRIu64 " of the metadata (expecting 2)",
+                        ERROR, part->n_fields < 2 ? part->n_fields : 1, line);
             }
-            field_num ++;
-            tokens = strtok(NULL, ",");
+            goto fail;
         }
 
-        // Deal with metadata that has < 2 fields
-        if (field_num < 2) {
-            log_msg("There is only %d field in the metadata (expecting 2)", ERROR, field_num);
-            return NULL;
+        uint32_t *to_global = malloc((part->labels.n > 0 ? part->labels.n : 1) * sizeof(uint32_t));
+        if (NULL == to_global) goto fail;
+        for (uint32_t lid = 0; lid < part->labels.n; lid++) {
+            const char *label = part->labels.by_id[lid]->label;
+            int64_t global = intern_label(labels, label, strlen(label));
+            if (global < 0) {
+                log_msg("Fail to allocate memory for labels", ERROR);
+                free(to_global);
+                goto fail;
+            }
+            to_global[lid] = (uint32_t) global;
         }
+        for (uint64_t j = 0; j < part->n_rows; j++) {
+            rt2label *s = part->rows[j], *found;
+            s->lid = to_global[s->lid];
+            HASH_FIND_BYHASHVALUE(hh, r2l, s->rt, s->hh.keylen, s->hh.hashv, found);
+            if (NULL == found) {
+                HASH_ADD_BYHASHVALUE(hh, r2l, rt[0], s->hh.keylen, s->hh.hashv, s);
+                continue;
+            }
+            // A barcode listed again goes to every label it is listed under
+            // (its second entry stays in the arena until the store is destroyed)
+            int64_t val = label_union(labels, found->lid, s->lid);
+            if (val < 0) {
+                log_msg("Fail to allocate memory for labels", ERROR);
+                free(to_global);
+                goto fail;
+            }
+            if (!(found->lid & LABEL_GROUP) && (val & LABEL_GROUP)) n_multi++;
+            found->lid = (uint32_t) val;
+        }
+        n_rows += part->n_rows;
+        free(to_global);
+        arena_absorb(&store->arena, &part->arena);
+    }
+    if (0 == n_rows) {
+        log_msg("There is no barcode in the metadata (%s)", ERROR, path);
+        goto fail;
+    }
+    log_msg("Parsed %" PRIu64 " rows of metadata on %u threads", DEBUG, n_rows, n_parts);
+    if (n_multi > 0) {
+        log_msg("%" PRIu64 " barcodes are listed under more than one label (%u label combinations)", INFO,
+                n_multi, HASH_COUNT(labels->group_index));
+    }
+    store->r2l = r2l;
+    goto cleanup;
 
-        // Prepare a new element for the hash table
-        rt2label *s;
-        // These hash tables must be freed through iteration!
-        s = (rt2label *)calloc(1, sizeof(rt2label));
+    fail:
+    store->r2l = r2l;
+    destroy_rt_store(store);
 
-        // Assign the read tag and label as a key-value pair
-        strcpy(s->rt, trt);
-        strcpy(s->label, tlabel);
+    cleanup:
+    for (uint32_t i = 0; NULL != parts && i < n_parts; i++) {
+        free(parts[i].rows);
+        destroy_labels(&parts[i].labels);
+        arena_destroy(&parts[i].arena);
+    }
+    free(parts);
+    if (mapped) {
+        munmap(text, len);
+    } else {
+        free(text);
+    }
+    return NULL == store->r2l;
+}
 
-        HASH_ADD_STR(r2l, rt, s);
+rt2label *new_rt2label(arena_t *arena, const char *rt, size_t len, uint32_t lid) {
+    /**
+     * @abstract Allocate a read-tag-to-label entry together with its key.
+     * @arena Arena to allocate from
+     * @rt, len The read tag (not necessarily NUL-terminated)
+     * @returns The entry; NULL on allocation failure
+     */
+    rt2label *s = arena_alloc(arena, sizeof(rt2label) + len + 1);
+    if (NULL == s) return NULL;
+    memcpy(s->rt, rt, len);
+    s->lid = lid;
+    return s;
+}
+
+int64_t intern_label(label_set_t *labels, const char *label, size_t len) {
+    /**
+     * @abstract Get the ID of a label, adding the label if it is new.
+     * @label, len The label (not necessarily NUL-terminated)
+     * @returns The label ID; -1 on allocation failure
+     */
+    label2fp *entry;
+    HASH_FIND(hh, labels->l2fp, label, len, entry);
+    if (entry) return entry->lid;
+
+    if (labels->n == labels->cap) {
+        uint32_t cap = labels->cap > 0 ? labels->cap * 2 : 16;
+        label2fp **by_id = realloc(labels->by_id, cap * sizeof(label2fp *));
+        if (NULL == by_id) return -1;
+        labels->by_id = by_id;
+        labels->cap = cap;
     }
-    fclose(meta_fp);
-    return r2l;
+    // Entries are freed with the arena in destroy_labels()
+    entry = (label2fp *) arena_alloc(&labels->arena, sizeof(label2fp) + len + 1);
+    if (NULL == entry) return -1;
+    memcpy(entry->label, label, len);
+    entry->lid = labels->n;
+    entry->dir = labels->n_dirs > 0 ? labels->n_dirs - 1 : 0;
+    labels->by_id[labels->n++] = entry;
+    HASH_ADD(hh, labels->l2fp, label[0], len, entry);
+    return entry->lid;
 }
 
-label2fp* hash_labels(rt2label *r2l, const char *prefix, sam_hdr_t *header) {
-    rt2label *s; // Declare a temporary variable to iterate over the rt2label table
-    label2fp *l2f = NULL; // Initialize l2f to hold the label2fp table
-    label2fp *tmp, *new_l2f; // Declare temporary variables for HASH_FIND_STR
-
-    // Loop over each element in the rt2label table
-    for (s = r2l; s != NULL; s = s->hh.next) {
-        HASH_FIND_STR(l2f, s->label, tmp);
-        // If a read tag-associated label already has a file handle
-        // Just move on
-        if (tmp) {
-            continue;
-        }
+int64_t label_union(label_set_t *labels, uint32_t val, uint32_t lid) {
+    /**
+     * @abstract Add a label to a label value, creating or reusing a label group when it then
+     * has more than one label.
+     * @val A label ID or label group (with LABEL_GROUP set)
+     * @returns The label value for val and lid together; -1 on allocation failure
+     */
+    const uint32_t *lids;
+    uint32_t n = label_ids(labels, &val, &lids);
+    uint32_t key[n + 2];
+    uint32_t k = 1;
+    for (uint32_t i = 0; i < n; i++) {
+        if (lids[i] == lid) return val;
+        if (lids[i] > lid && k == i + 1) key[k++] = lid;
+        key[k++] = lids[i];
+    }
+    if (k == n + 1) key[k++] = lid;
+    key[0] = n + 1;
 
-        // If the label is new, calloc() for a new element
-        // These hash tables must be freed through iteration!
-        new_l2f = (label2fp *)calloc(1, sizeof(label2fp));
+    label_group *group;
+    HASH_FIND(hh, labels->group_index, key, k * sizeof(uint32_t), group);
+    if (NULL != group) return LABEL_GROUP | group->off;
 
-        // Populate the label (key) for the new element
-        strcpy(new_l2f->label, s->label);
+    if (labels->n_group_words + k > labels->group_cap) {
+        uint32_t cap = labels->group_cap > 0 ? labels->group_cap : 64;
+        while (labels->n_group_words + k > cap) cap *= 2;
+        if (cap >= LABEL_GROUP) return -1;
+        uint32_t *groups = realloc(labels->groups, cap * sizeof(uint32_t));
+        if (NULL == groups) return -1;
+        labels->groups = groups;
+        labels->group_cap = cap;
+    }
+    group = arena_alloc(&labels->arena, sizeof(label_group) + k * sizeof(uint32_t));
+    if (NULL == group) return -1;
+    memcpy(group->lids, key, k * sizeof(uint32_t));
+    group->off = labels->n_group_words;
+    memcpy(labels->groups + group->off, key, k * sizeof(uint32_t));
+    labels->n_group_words += k;
+    HASH_ADD(hh, labels->group_index, lids[0], k * sizeof(uint32_t), group);
+    return LABEL_GROUP | group->off;
+}
+
+int8_t label_namespace(label_set_t *labels, const char *dir) {
+    /**
+     * @abstract Start the labels of another metadata table, whose outputs go to a subdirectory.
+     * Labels added before keep their IDs but are no longer matched by name, so the same label
+     * in two tables gets two outputs.
+     * @dir Name of the subdirectory in the output directory
+     * @returns 0 on success; 1 on allocation failure
+     */
+    char **dirs = realloc(labels->dirs, (labels->n_dirs + 1) * sizeof(char *));
+    if (NULL == dirs) return 1;
+    labels->dirs = dirs;
+    if (NULL == (labels->dirs[labels->n_dirs] = strdup(dir))) return 1;
+    labels->n_dirs++;
+    HASH_CLEAR(hh, labels->l2fp);
+    return 0;
+}
 
-        // Prepare output file path
-        char outpath[MAX_LINE_LENGTH];
-        uint32_t label_size = strlen(s->label);
-        char label_corrected[label_size + 1];
+char *label_outpath(label_set_t *labels, uint32_t lid, const char *prefix) {
+    /**
+     * @abstract Path of the output BAM file of a label (in the subdirectory of its metadata table
+     * when there are several), with slashes in the label replaced by hyphens.
+     * @returns The path, to be freed by the caller; NULL on allocation failure
+     */
+    label2fp *entry = labels->by_id[lid];
+    const char *dir = labels->n_dirs > 0 ? labels->dirs[entry->dir] : "";
+    size_t label_size = strlen(entry->label);
+    char *outpath = malloc(strlen(prefix) + strlen(dir) + label_size + 6);
+    if (NULL == outpath) return NULL;
 
-        strcpy(label_corrected, s->label);
-        for (int i = 0; i < label_size; i++) {
-            // Replace slashes with hyphens when creating output files
-            if (label_corrected[i] == '/') {
-                label_corrected[i] = '-';
-            }
+    // Concatenate output path
+    strcpy(outpath, prefix);
+    if (labels->n_dirs > 0) {
+        strcat(outpath, dir);
+        strcat(outpath, "/");
+    }
+    char *label_corrected = outpath + strlen(outpath);
+    strcat(outpath, entry->label);
+    for (size_t i = 0; i < label_size; i++) {
+        // Replace slashes with hyphens when creating output files
+        if (label_corrected[i] == '/') {
+            label_corrected[i] = '-';
         }
+    }
+    strcat(outpath, ".bam");
+    return outpath;
+}
 
-        // Concatenate output path
-        strcpy(outpath, prefix);
-        strcat(outpath, label_corrected);
-        strcat(outpath, ".bam");
+int8_t hash_labels(label_set_t *labels, const char *prefix, sam_hdr_t *header, int64_t buf_size,
+                   uint32_t max_open) {
+    /**
+     * @abstract Create an output BAM file for every label (in the subdirectory of its metadata
+     * table when there are several).
+     * @buf_size Bytes of compressed output to collect for each file before writing; 0 for the default
+     * @max_open Most outputs to keep open at once: with more labels, outputs are created as reads
+     * come through spill files (see spill_t)
+     * @returns 0 on success; 1 on failure
+     */
+    for (uint16_t dir = 0; dir < labels->n_dirs; dir++) {
+        char dirpath[strlen(prefix) + strlen(labels->dirs[dir]) + 1];
+        strcpy(dirpath, prefix);
+        strcat(dirpath, labels->dirs[dir]);
+        if (0 != mkdir(dirpath, 0700) && EEXIST != errno) {
+            log_msg("Fail to create directory %s (Error: %s)", ERROR, dirpath, strerror(errno));
+            return 1;
+        }
+    }
+    if (labels->n > max_open) {
+        log_msg("%u labels are more than the %u outputs that can be open at once; reads are spilled to "
+                "temporary files first", INFO, labels->n, max_open);
+        labels->spill = spill_init(labels, prefix, header, max_open);
+        return NULL == labels->spill ? 1 : 0;
+    }
+    for (uint32_t lid = 0; lid < labels->n; lid++) {
+        label2fp *new_l2f = labels->by_id[lid];
+        char *outpath = label_outpath(labels, lid, prefix);
+        if (NULL == outpath) {
+            log_msg("Fail to allocate memory for output paths", ERROR);
+            return 1;
+        }
 
         // Create file handle from the path generated above
         // These handles must be closed manually!
-        new_l2f->fp = sam_open(outpath, "wb");
+        new_l2f->fp = sam_open(outpath, OUT_MODE);
+        attach_hts_pool(new_l2f->fp);
+        // Compressed blocks pile up in the file buffer and go out in one write() once it is full
+        if (buf_size > 0 && 0 != hts_set_opt(new_l2f->fp, HTS_OPT_BLOCK_SIZE, (int) buf_size)) {
+            log_msg("Fail to enlarge the output buffer of %s", WARNING, outpath);
+        }
+        free(outpath);
 
         // Populate header
         uint8_t hdr_write;
@@ -136,11 +474,32 @@ label2fp* hash_labels(rt2label *r2l, const char *prefix, sam_hdr_t *header) {
 
         if (hdr_write != 0) {
             log_msg("Fail to prepare individual output files", ERROR);
-            return NULL;
+            return 1;
         }
+    }
+    return 0;
+}
 
-        // Add the new element to the hash table
-        HASH_ADD_STR(l2f, label, new_l2f);
+void destroy_labels(label_set_t *labels) {
+    // Labels of earlier metadata tables are only in by_id
+    HASH_CLEAR(hh, labels->l2fp);
+    spill_destroy(labels->spill);
+    labels->spill = NULL;
+    for (uint32_t lid = 0; lid < labels->n; lid++) {
+        if (NULL != labels->by_id[lid]->fp) sam_close(labels->by_id[lid]->fp);
     }
-    return l2f;
+    for (uint16_t dir = 0; dir < labels->n_dirs; dir++) free(labels->dirs[dir]);
+    free(labels->dirs);
+    labels->dirs = NULL;
+    labels->n_dirs = 0;
+    HASH_CLEAR(hh, labels->group_index);
+    arena_destroy(&labels->arena);
+    free(labels->groups);
+    labels->groups = NULL;
+    labels->n_group_words = 0;
+    labels->group_cap = 0;
+    free(labels->by_id);
+    labels->by_id = NULL;
+    labels->n = 0;
+    labels->cap = 0;
 }
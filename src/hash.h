@@ -6,21 +6,86 @@
 #include "htslib/sam.h"
 #include "uthash.h"
 #include "shared_const.h"
+#include "arena.h"
 
+// Keys are allocated together with their entry, so neither has a length limit
 typedef struct {
-    char rt[MAX_LINE_LENGTH];             /* key (string is WITHIN the structure) */
-    char label[MAX_LINE_LENGTH];
+    uint32_t lid;              /* ID of the label or label group (see label_set_t) */
     UT_hash_handle hh;         /* makes this structure hashable */
+    char rt[];                 /* key (string is WITHIN the structure) */
 } rt2label;
 
+// A read-tag-to-label table with the arena its entries are allocated from
 typedef struct {
-    char label[MAX_LINE_LENGTH];             /* key (string is WITHIN the structure) */
+    rt2label *r2l;
+    arena_t arena;
+} rt_store_t;
+
+// A distinct set of labels that barcodes belong to together
+typedef struct {
+    uint32_t off;              /* offset of the group in label_set_t.groups */
+    UT_hash_handle hh;
+    uint32_t lids[];           /* key: number of labels, then label IDs in ascending order */
+} label_group;
+
+// Label values with this bit set refer to a label group instead of a single label
+#define LABEL_GROUP 0x80000000u
+
+typedef struct {
+    uint32_t lid;
+    uint16_t dir;              /* metadata table the label comes from (see label_set_t.dirs) */
     samFile* fp;
     UT_hash_handle hh;         /* makes this structure hashable */
+    char label[];              /* key (string is WITHIN the structure) */
 } label2fp ;
 
-rt2label* hash_readtag(char *path);
-label2fp* hash_labels(rt2label *r2l, const char *prefix, sam_hdr_t *header);
+struct spill;
+
+// Labels interned to dense IDs (in order of first appearance in the metadata), so per-read
+// work can index arrays instead of hashing label strings
+typedef struct {
+    label2fp *l2fp;            /* label -> entry (for the latest metadata table) */
+    label2fp **by_id;          /* entries indexed by label ID */
+    uint32_t n;
+    uint32_t cap;
+    // Barcodes listed under several labels: groups are stored back to back as the number of
+    // labels followed by the label IDs
+    uint32_t *groups;
+    uint32_t n_group_words;
+    uint32_t group_cap;
+    label_group *group_index;  /* group -> offset, to share groups between barcodes */
+    // Output subdirectories of metadata tables, with several tables (see label_namespace())
+    char **dirs;
+    uint16_t n_dirs;
+    arena_t arena;             /* memory of label entries and groups */
+    struct spill *spill;       /* outputs written through spill files (NULL if all are open) */
+} label_set_t;
+
+static inline uint32_t label_ids(const label_set_t *labels, const uint32_t *val, const uint32_t **lids) {
+    /**
+     * @abstract Resolve a label value (from bctable_find()) into label IDs.
+     * @lids Returns the label IDs (pointing to val itself for a single label)
+     * @returns The number of label IDs
+     */
+    if (*val & LABEL_GROUP) {
+        const uint32_t *group = labels->groups + (*val & ~LABEL_GROUP);
+        *lids = group + 1;
+        return group[0];
+    }
+    *lids = val;
+    return 1;
+}
+
+int8_t hash_readtag(char *path, label_set_t *labels, rt_store_t *store);
+rt2label *new_rt2label(arena_t *arena, const char *rt, size_t len, uint32_t lid);
+void destroy_rt_store(rt_store_t *store);
+int64_t intern_label(label_set_t *labels, const char *label, size_t len);
+int64_t label_union(label_set_t *labels, uint32_t val, uint32_t lid);
+int8_t label_namespace(label_set_t *labels, const char *dir);
+char *label_outpath(label_set_t *labels, uint32_t lid, const char *prefix);
+int8_t hash_labels(label_set_t *labels, const char *prefix, sam_hdr_t *header, int64_t buf_size,
+                   uint32_t max_open);
+void destroy_labels(label_set_t *labels);
 
 
 #endif //SCBAMSPLIT_HASH_H
@@ -3,15 +3,22 @@
 #include <stdio.h>   /* printf */
 #include <getopt.h>  /* getopt */
 #include <stdbool.h> /* Define boolean type */
+#include <inttypes.h> /* SCNd64 */
 #include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h> /* mkdir() */
 #include "htslib/sam.h" /* Use htslib to interact with bam files, imports stdint.h as well */
+#include "htslib/thread_pool.h" /* Shared BGZF (de)compression threads */
 #include "uthash.h"  /* hash table */
 #include "hash.h"    /* Defining the hash tables actually used */
 #include "utils.h" /* Show help and create output dir */
 #include "sort.h"
+#include "shard.h"
+#include "pipeline.h"
+#include "spill.h"
 
-#define rdump(...) read_dump(r2l, lout, l2fp, fout, __VA_ARGS__)
-#define ddump(...) deduped_dump(r2l, lout, l2fp, fout, __VA_ARGS__)
+#define rdump(...) read_dump(&labels, __VA_ARGS__)
+#define ddump(...) deduped_dump(bct, &labels, __VA_ARGS__)
 
 // Dealing with global vars
 char *OUT_PATH = "";
@@ -25,6 +32,34 @@ int64_t CB_LENGTH = 21;
 int64_t UB_LENGTH = 21;
 int64_t chunk_size = 500000; // Approximately 1GB
 int64_t MAX_THREADS = 1;
+htsThreadPool HTS_POOL = {NULL, 0};
+// Modes for sam_open()/bgzf_open() of outputs and of temporary files, which are read back once
+char OUT_MODE[4] = "wb";
+char TMP_MODE[4] = "wb1";
+barcode_reader_t BARCODES = {get_barcodes, get_barcodes, get_barcodes};
+
+static void meta_dir_name(const char *metapath, char *dir) {
+    // Output subdirectory of a metadata table: its file name without extensions such as .csv.gz
+    const char *base = strrchr(metapath, '/');
+    strcpy(dir, NULL == base ? metapath : base + 1);
+    size_t len = strlen(dir);
+    if (len > 3 && 0 == strcmp(dir + len - 3, ".gz")) dir[len - 3] = 0;
+    char *ext = strrchr(dir, '.');
+    if (NULL != ext && ext != dir) *ext = 0;
+}
+
+// Values for options that only have a long form
+enum long_only_opt {
+    OPT_SHARD = 1000,
+    OPT_MPHF,
+    OPT_PREFILTER,
+    OPT_CB_SORTED,
+    OPT_CORRECT,
+    OPT_WRITE_BUFFER,
+    OPT_MAX_OPEN,
+    OPT_LEVEL,
+    OPT_TMP_LEVEL
+};
 
 int main(int argc, char *argv[]) {
     // Use a flag to bypass commandline input during development
@@ -37,6 +72,9 @@ int main(int argc, char *argv[]) {
     bool dedup = false, dryrun = false, verbose = false;
     char *bampath = NULL;
     char *metapath = NULL;
+    // Every -m given; with more than one, outputs of each go to their own subdirectory
+    char *metapaths[argc];
+    int32_t n_meta = 0;
     char *oprefix = NULL;
     tag_meta_t *cb_meta = initialize_tag_meta();
     tag_meta_t *ub_meta = initialize_tag_meta();
@@ -46,6 +84,35 @@ int main(int argc, char *argv[]) {
     char bc_tag[3] = "CB";
     char umi_tag[3] = "UB";
     int32_t return_val = 0;
+    int64_t shard_i = 0, shard_n = 0;
+    bool finalize = false;
+    bool use_mphf = false;
+    bool use_bloom = false;
+    bool cb_sorted = false;
+    bool correct = false;
+    // Bytes of output buffered for every label before it is written; 0 keeps htslib's default
+    int64_t write_buffer = 0;
+    // Outputs open at once; with more labels, reads are spilled first (0: from the open file limit)
+    int64_t max_open = 0;
+
+    // "scbamsplit compile-meta meta.csv meta.bin" prepares metadata for fast loading
+    if (argc > 1 && strcmp(argv[1], "compile-meta") == 0) {
+        destroy_tag_meta(cb_meta);
+        destroy_tag_meta(ub_meta);
+        if (argc != 4) {
+            log_msg("Usage: scbamsplit compile-meta metadata.csv output", ERROR);
+            return 1;
+        }
+        bc_pack_init();
+        return compile_meta(argv[2], argv[3]);
+    }
+
+    // "scbamsplit finalize ..." combines the partial results of --shard runs
+    if (argc > 1 && strcmp(argv[1], "finalize") == 0) {
+        finalize = true;
+        argc--;
+        argv++;
+    }
 
     // Commandline argument processing
     static struct option cl_opts[] = {
@@ -64,7 +131,17 @@ int main(int argc, char *argv[]) {
             {"threads", required_argument, NULL, '@'},
             {"dry-run", no_argument, NULL, 'n'},
             {"verbose", optional_argument, NULL, 'v'},
-            {"help", no_argument, NULL, 'h'}
+            {"shard", required_argument, NULL, OPT_SHARD},
+            {"mphf", no_argument, NULL, OPT_MPHF},
+            {"prefilter", no_argument, NULL, OPT_PREFILTER},
+            {"cb-sorted", no_argument, NULL, OPT_CB_SORTED},
+            {"correct", no_argument, NULL, OPT_CORRECT},
+            {"write-buffer", required_argument, NULL, OPT_WRITE_BUFFER},
+            {"max-open", required_argument, NULL, OPT_MAX_OPEN},
+            {"level", required_argument, NULL, OPT_LEVEL},
+            {"tmp-level", required_argument, NULL, OPT_TMP_LEVEL},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0}
     };
 
     log_msg("Parsing commandline flags", DEBUG);
@@ -76,7 +153,8 @@ int main(int argc, char *argv[]) {
                 bampath = optarg;
                 break;
             case 'm':
-                metapath = optarg;
+                if (NULL == metapath) metapath = optarg;
+                metapaths[n_meta++] = optarg;
                 break;
             case 'o':
                 oprefix = optarg;
@@ -153,6 +231,55 @@ int main(int argc, char *argv[]) {
             case 'n':
                 dryrun = true;
                 break;
+            case OPT_SHARD:
+                if (2 != sscanf(optarg, "%" SCNd64 "/%" SCNd64, &shard_i, &shard_n) ||
+                    shard_n < 1 || shard_i < 1 || shard_i > shard_n) {
+                    log_msg("--shard must be i/N with 1 <= i <= N (e.g., 3/16)", ERROR);
+                    goto error_out_and_free;
+                }
+                break;
+            case OPT_MPHF:
+                use_mphf = true;
+                break;
+            case OPT_PREFILTER:
+                use_bloom = true;
+                break;
+            case OPT_CB_SORTED:
+                cb_sorted = true;
+                break;
+            case OPT_CORRECT:
+                correct = true;
+                break;
+            case OPT_WRITE_BUFFER:
+                write_buffer = strtol(optarg, NULL, 10);
+                if (write_buffer < 1 || write_buffer > 1024) {
+                    log_msg("Output buffer size (--write-buffer) must be an integer between 1 and 1024 (MB)", ERROR);
+                    goto error_out_and_free;
+                }
+                write_buffer <<= 20;
+                break;
+            case OPT_MAX_OPEN:
+                max_open = strtol(optarg, NULL, 10);
+                if (max_open < 1 || max_open > UINT32_MAX) {
+                    log_msg("Number of open outputs (--max-open) must be a positive integer", ERROR);
+                    goto error_out_and_free;
+                }
+                break;
+            case OPT_LEVEL:
+                if (optarg[0] < '0' || optarg[0] > '9' || optarg[1] != 0) {
+                    log_msg("Compression level (--level) must be between 0 and 9", ERROR);
+                    goto error_out_and_free;
+                }
+                OUT_MODE[2] = optarg[0];
+                break;
+            case OPT_TMP_LEVEL:
+                if (((optarg[0] < '0' || optarg[0] > '9') && optarg[0] != 'u') || optarg[1] != 0) {
+                    log_msg("Compression level of temporary files (--tmp-level) must be between 0 and 9, "
+                            "or u (uncompressed)", ERROR);
+                    goto error_out_and_free;
+                }
+                TMP_MODE[2] = optarg[0];
+                break;
             case 'v':
                 // Manual optional results in possible consumption of the next flag and has to be dealt
                 // with
@@ -205,7 +332,8 @@ int main(int argc, char *argv[]) {
     }
 
     // Set chunk size by mem estimation
-    chunk_size = (chunk_size * mem_scale - 100000) / MAX_THREADS;
+    // (output buffers may take up to a quarter of it)
+    chunk_size = (chunk_size * mem_scale * (write_buffer > 0 ? 3 : 4) / 4 - 100000) / MAX_THREADS;
 
     // If the output prefix does not end with /, add it.
     uint16_t oplen = strlen(oprefix) - 1;
@@ -213,6 +341,11 @@ int main(int argc, char *argv[]) {
         oprefix = strcat(oprefix, "/");
     }
 
+    if (finalize && shard_n > 0) {
+        log_msg("--shard cannot be used with finalize", ERROR);
+        return 1;
+    }
+
     if (mapq_thres > 254) {
         fprintf(stderr, "Please note that the maximal value of MAPQ is 255.\n");
         fprintf(stderr, "There is no read that would have MAPQ **ABOVE** the current threshold (%lld) and be kept.\n",
@@ -220,15 +353,46 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // Tag metadata is final from here on
+    choose_barcode_reader(cb_meta, ub_meta);
+    log_msg("Packing barcodes with the %s kernel", DEBUG, bc_pack_init());
+
     if (verbose || dryrun) {
         fprintf(stderr, "- Run condition:\n");
         fprintf(stderr, "\tInput bam: %s\n", bampath);
-        fprintf(stderr, "\tInput metadata: %s\n", metapath);
+        for (int32_t i = 0; i < n_meta; i++) {
+            fprintf(stderr, "\tInput metadata: %s\n", metapaths[i]);
+        }
         fprintf(stderr, "\tMAPQ threshold: %lld\n", mapq_thres);
         fprintf(stderr, "\tRead name length: %lldmer\n", RN_SIZE - 1);
         fprintf(stderr, "\tOutput prefix: %s\n", oprefix);
         fprintf(stderr, "\tMemory usage is estimated to be: %lldGB\n", mem_scale);
         fprintf(stderr, "\tLogging level is %d\n", OUT_LEVEL);
+        if (shard_n > 0) {
+            fprintf(stderr, "\tProcessing shard %" PRId64 " of %" PRId64 "\n", shard_i, shard_n);
+        } else if (finalize) {
+            fprintf(stderr, "\tCombining results of all shards\n");
+        }
+        if (use_mphf) {
+            fprintf(stderr, "\tLooking up barcodes through a minimal perfect hash\n");
+        }
+        if (use_bloom) {
+            fprintf(stderr, "\tRejecting barcodes not in the metadata with a Bloom filter first\n");
+        }
+        if (cb_sorted) {
+            fprintf(stderr, "\tInput is sorted by cell barcode\n");
+        }
+        if (correct) {
+            fprintf(stderr, "\tCorrecting cell barcodes one substitution away from the metadata\n");
+        }
+        if (write_buffer > 0) {
+            fprintf(stderr, "\tBuffering %" PRId64 "MB of output per label\n", write_buffer >> 20);
+        }
+        if (max_open > 0) {
+            fprintf(stderr, "\tKeeping at most %" PRId64 " files open\n", max_open);
+        }
+        fprintf(stderr, "\tCompression level: %s (output), %s (temporary files)\n",
+                OUT_MODE[2] ? OUT_MODE + 2 : "default", 'u' == TMP_MODE[2] ? "uncompressed" : TMP_MODE + 2);
         print_tag_meta(cb_meta, "Cell barcode");
         print_tag_meta(ub_meta, "UMI");
         if (dedup) {
@@ -257,9 +421,15 @@ int main(int argc, char *argv[]) {
 
     // Create output folder if it does not exist
     // If it exists, ask the user for confirmation to prevent unexpected overwriting
+    // (except for array tasks and finalize, which are expected to share the directory)
     log_msg("Creating output directory", INFO);
     int mkdir_status;
-    if (1 == (mkdir_status = create_directory(oprefix))) {
+    if (shard_n > 0 || finalize) {
+        if (0 != mkdir(oprefix, 0700) && EEXIST != errno) {
+            log_msg("Fail to create directory (Error: %s)", ERROR, strerror(errno));
+            return 1;
+        }
+    } else if (1 == (mkdir_status = create_directory(oprefix))) {
         log_msg("Exiting because the user declined overwrite", INFO);
         log_msg("Please provide a new path for the output directory", WARNING );
         return 0;
@@ -268,11 +438,39 @@ int main(int argc, char *argv[]) {
     }
 
     ////////// bam related //////////////////////////////////////////////
+    // The BGZF codec is whatever the htslib loaded at run time was built with
+    bool with_libdeflate = 0 != (hts_features() & HTS_FEATURE_LIBDEFLATE);
+    log_msg("BGZF codec: %s (htslib %s)", INFO, with_libdeflate ? "libdeflate" : "zlib", hts_version());
+#ifdef SCBAMSPLIT_LIBDEFLATE
+    if (!with_libdeflate) {
+        log_msg("Built for an htslib with libdeflate, but the htslib loaded uses zlib (check LD_LIBRARY_PATH)",
+                WARNING);
+    }
+#endif
     // Open input bam file from CellRanger
     // Remember to close file handle!
     log_msg("Reading input BAM file: %s", INFO, bampath);
     samFile *fp = sam_open(bampath, "r");
 
+    // One htslib thread pool is shared by the input, every output, and temporary files
+    // so BGZF inflate/deflate is no longer single-threaded.
+    // An input that cannot be read in parallel goes through the split pipeline (see
+    // pipeline_split()), whose threads take half of -@ from the pool
+    int64_t pool_threads = MAX_THREADS, pipe_threads = 0;
+    if (MAX_THREADS > 1) pipe_threads = MAX_THREADS / 2 > 2 ? MAX_THREADS / 2 : 2;
+    if (!dedup && !cb_sorted && 0 == shard_n && !finalize && MAX_THREADS > 1 &&
+        !can_read_in_parallel(fp, bampath)) {
+        pool_threads = MAX_THREADS - MAX_THREADS / 2;
+    }
+    if (MAX_THREADS > 1) {
+        log_msg("Creating a shared pool of %" PRId64 " threads for BAM compression", DEBUG, pool_threads);
+        HTS_POOL.pool = hts_tpool_init(pool_threads);
+        if (NULL == HTS_POOL.pool) {
+            log_msg("Fail to create the thread pool for BAM compression; continue single-threaded", WARNING);
+        }
+    }
+    attach_hts_pool(fp);
+
 
     // Extract header
     log_msg("Reading SAM header", DEBUG);
@@ -285,62 +483,199 @@ int main(int argc, char *argv[]) {
     bam1_t *read = bam_init1();
 
     // Prepare a read-tag-to-label hash table from a metadata table
-    log_msg("Loading barcode-cluster information from metadata: %s", INFO, metapath);
-    rt2label *r2l = hash_readtag((char *) metapath);
-
-    if (r2l == NULL) {
-        log_msg("Failed to hash the metadata.", ERROR);
-        return 1;
+    // Labels are interned to IDs on the way
+    label_set_t labels = {0};
+    bctable_t *bct = NULL;
+    if (1 == n_meta && is_compiled_meta(metapath)) {
+        // Output of "scbamsplit compile-meta" is mapped as is
+        log_msg("Loading barcode-cluster information from metadata: %s", INFO, metapath);
+        bct = bctable_load(metapath, &labels, use_mphf, use_bloom);
+    } else {
+        // Several tables are loaded into one lookup table, so every read is still looked up once;
+        // a barcode in more than one table gets the labels of all of them
+        rt_store_t store = {NULL};
+        int8_t failed = 0;
+        for (int32_t i = 0; !failed && i < n_meta; i++) {
+            log_msg("Loading barcode-cluster information from metadata: %s", INFO, metapaths[i]);
+            if (n_meta > 1) {
+                char dir[strlen(metapaths[i]) + 1];
+                meta_dir_name(metapaths[i], dir);
+                for (uint16_t j = 0; j < labels.n_dirs; j++) {
+                    if (0 == strcmp(labels.dirs[j], dir)) dir[0] = 0;
+                }
+                if (is_compiled_meta(metapaths[i]) || 0 == dir[0]) {
+                    log_msg("With several -m, metadata must be text files with distinct names (%s)",
+                            ERROR, metapaths[i]);
+                    failed = 1;
+                    break;
+                }
+                if (0 != label_namespace(&labels, dir)) {
+                    log_msg("Fail to allocate memory for labels", ERROR);
+                    failed = 1;
+                    break;
+                }
+            }
+            failed = hash_readtag(metapaths[i], &labels, &store);
+        }
+        if (failed) {
+            log_msg("Failed to hash the metadata.", ERROR);
+            destroy_rt_store(&store);
+            return_val = 1;
+            goto early_exit;
+        }
+        // Barcodes made of ACGT are looked up by their 2-bit packed form
+        // (the parsed metadata is freed once the lookup table is built)
+        bct = bctable_build(&store, use_mphf, use_bloom);
+        if (NULL == bct) destroy_rt_store(&store);
+    }
+    if (NULL == bct) {
+        return_val = 1;
+        goto early_exit;
+    }
+    bct->correct = correct;
+
+    // Input sorted by cell barcode (samtools sort -t) is read in one stream instead, so reading can
+    // stop after the last barcode of the metadata (known before outputs are opened, as it rules out
+    // the segments of a parallel split)
+    if (!dedup && !cb_sorted && 0 == shard_n && !finalize && cb_sorted_header(header, cb_meta)) {
+        log_msg("The input is sorted by %s according to its header", INFO, cb_meta->tag_name);
+        cb_sorted = true;
     }
 
-    // Prepare a label-to-file-handle hash table from the above
-    log_msg("Preparing output BAM files", INFO);
-    label2fp *l2fp = NULL;
-    l2fp = hash_labels(r2l, oprefix, header);
+    // Reading in parallel needs files for the segments of every thread besides the outputs (see
+    // segment_budget())
+    int64_t seg_files = MAX_THREADS * (SHARD_MIN_SEGMENTS + 1);
+    bool may_shard = !dedup && !cb_sorted && MAX_THREADS > 1;
+    // The soft limit of open files is only raised when outputs would be spilled under it, or
+    // --max-open asks for more
+    uint64_t fd_limit = open_file_limit();
+    int64_t fd_budget = open_file_budget(fd_limit);
+    if (max_open > fd_budget || (0 == max_open && labels.n + (may_shard ? seg_files : 0) > fd_budget)) {
+        fd_limit = raise_open_file_limit();
+    }
+    if (0 == max_open) max_open = open_file_budget(fd_limit);
+
+    // Open an output file for every label
+    // Array tasks only write partial results; outputs are created by finalize
+    if (0 == shard_n) {
+        log_msg("Preparing output BAM files", INFO);
+        if (write_buffer > 0 && labels.n > 0) {
+            // All output buffers together stay within a quarter of -M
+            int64_t budget = (mem_scale << 30) / 4;
+            if (write_buffer * (int64_t) labels.n > budget) {
+                write_buffer = budget / labels.n;
+                if (write_buffer < BGZF_MAX_BLOCK_SIZE) {
+                    log_msg("Too many labels for output buffers within -M; using default buffers", WARNING);
+                    write_buffer = 0;
+                } else {
+                    log_msg("Output buffers are shrunk to %" PRId64 " KB per label to stay within -M", WARNING,
+                            write_buffer >> 10);
+                }
+            }
+        }
+        // Labels beyond what the segments of a parallel split leave go through spill files, which
+        // keep outputs closed
+        uint32_t out_budget = (uint32_t) max_open;
+        if (may_shard && max_open > 2 * seg_files) {
+            out_budget = (uint32_t) (max_open - seg_files);
+        }
+        if (0 != hash_labels(&labels, oprefix, header, write_buffer, out_budget)) {
+            return_val = 1;
+            goto early_exit;
+        }
+    }
 
     // Iterate through the rt's and write to corresponding file handles.
     // Iterate through reads from input bam
-    rt2label *lout;
-    label2fp *fout;
     int32_t read_stat;
 
 
-    if (!dedup) {
-        char *current_CB;
-        char *this_CB;
-        char *this_UB;
-        current_CB = (char *) calloc(CB_LENGTH, sizeof(char));
-        this_CB = (char *) calloc(CB_LENGTH, sizeof(char));
-        this_UB = (char *) calloc(UB_LENGTH, sizeof(char));
-        while (0 <= (read_stat = sam_read1(fp, header, read))) {
-            // Get read metadata
-            int8_t ub_stat = get_UB(read, ub_meta, this_UB);
-            int8_t cb_stat = get_CB(read, cb_meta, this_CB);
-            int16_t mapq = (int16_t) read->core.qual;
+    if (shard_n > 0) {
+        if (0 != shard_task(fp, bampath, header, bct, &labels, oprefix, shard_i, shard_n, dedup, chunk_size,
+                            mapq_thres, cb_meta, ub_meta, (uint32_t) max_open)) {
+            log_msg("Fail to process shard %" PRId64 "/%" PRId64, ERROR, shard_i, shard_n);
+            return_val = 1;
+        } else {
+            log_msg("Shard %" PRId64 "/%" PRId64 " is done; run \"scbamsplit finalize\" once all shards are done", INFO,
+                    shard_i, shard_n);
+        }
+        goto early_exit;
+    }
+
+    if (finalize && !dedup) {
+        if (NULL == finalize_shards(oprefix, dedup, &labels)) {
+            log_msg("Fail to combine the results of all shards", ERROR);
+            return_val = 1;
+        }
+        goto early_exit;
+    }
 
-            if (-1 == cb_stat || -1 == ub_stat || mapq < mapq_thres) {
-                // Ignore reads without CB and UMI for consistency
-                continue;
+    // With more than one thread, every thread reads its own part of the input when possible
+    int8_t split_stat = -1;
+    if (!dedup && !cb_sorted) {
+        split_stat = parallel_split(fp, bampath, header, bct, &labels, oprefix, mapq_thres, cb_meta, ub_meta,
+                                    (uint32_t) max_open);
+        if (1 == split_stat) {
+            log_msg("Fail to split the input in parallel", ERROR);
+            return_val = 1;
+        }
+    }
+    // Otherwise (e.g., streams), reading stays on one thread but lookups and writing do not
+    // (not with spill files, whose outputs are opened and closed as reads come)
+    if (!dedup && !cb_sorted && NULL == labels.spill && -1 == split_stat) {
+        split_stat = pipeline_split(fp, header, bct, &labels, mapq_thres, cb_meta, ub_meta, pipe_threads);
+        if (1 == split_stat) {
+            log_msg("Fail to split the input", ERROR);
+            return_val = 1;
+        }
+    }
+
+    if (!dedup && -1 == split_stat) {
+        tag_view_t cb_view;
+        // Consecutive reads of a cell share one lookup
+        // (no early stop with --correct: barcodes sorting after the last one of the metadata may
+        // still be corrected to it)
+        cb_run_t run;
+        cb_run_init(&run, bct, cb_sorted && !bct->correct);
+
+        // BAM records are passed to the outputs as the raw bytes read from the input,
+        // which saves decoding them into bam1_t and encoding them back
+        raw_read_t *raw = raw_supported(fp) ? raw_read_init() : NULL;
+        bam1_t *this_read = NULL == raw ? read : &raw->view;
+        while (0 <= (read_stat = NULL == raw ? sam_read1(fp, header, read) : raw_read1(fp->fp.bgzf, raw))) {
+            // Get read metadata
+            int64_t val = label_of_read(this_read, bct, cb_meta, ub_meta, mapq_thres, &cb_view, &run);
+            if (run.done) {
+                log_msg("Every cell barcode in the metadata has been passed; skipping the rest of the input", INFO);
+                break;
             }
+            if (val < 0) continue;
+
             // Exporting process
-            int8_t rdump_stat = rdump(this_CB, header, read);
+            int8_t rdump_stat = rdump(val, header, this_read, raw);
             if (0 != rdump_stat) {
-                log_msg("Fail to write sorted reads to individual BAM file (%s)", ERROR, lout->label);
+                log_msg("Fail to write sorted reads to individual BAM file (%.*s)", ERROR,
+                        cb_view.len, cb_view.s);
             }
         }
+        if (read_stat < -1) {
+            log_msg("Fail to read the input BAM file (truncated or corrupted?)", ERROR);
+            return_val = 1;
+        }
         // No-dedup split done
-        free(current_CB);
-        free(this_CB);
-        free(this_UB);
-    } else {
+        raw_read_destroy(raw);
+        cb_run_destroy(&run);
+    } else if (dedup) {
         // Deduplication-specific code
         log_msg("Processing %lld reads per chunk", INFO, chunk_size);
 
         // Allocate heap memory for reads to sort
         log_msg("Preparing read chunks for sorting", DEBUG);
 
-        char* tmpdir = process_bam(fp, header, chunk_size, oprefix, mapq_thres, cb_meta, ub_meta);
-        if (strcmp(tmpdir, "1") == 0) {
+        // finalize picks up the chunks sorted by all array tasks instead of sorting the input
+        char* tmpdir = finalize ? finalize_shards(oprefix, dedup, &labels) :
+                       process_bam(fp, NULL, header, chunk_size, oprefix, mapq_thres, cb_meta, ub_meta);
+        if (NULL == tmpdir || strcmp(tmpdir, "1") == 0) {
             return_val = 1;
             goto early_exit;
         }
@@ -361,20 +696,22 @@ int main(int argc, char *argv[]) {
 
     // Release and exit
 early_exit:
+    // Spilled reads are copied to their outputs
+    if (NULL != labels.spill && 0 == return_val && 0 != spill_finish(labels.spill)) {
+        log_msg("Fail to copy spilled reads to the outputs", ERROR);
+        return_val = 1;
+    }
     sam_close(fp);
     bam_hdr_destroy(header);
-    label2fp *qs, *qtmp;
-    HASH_ITER(hh, l2fp, qs, qtmp) {
-        sam_close(qs->fp);
-        HASH_DEL(l2fp, qs);
-        free(qs);
-    }
+    destroy_labels(&labels);
 
     // free the hash table contents
-    rt2label *s, *tmp;
-    HASH_ITER(hh, r2l, s, tmp) {
-        HASH_DEL(r2l, s);
-        free(s);
+    bctable_destroy(bct);
+
+    // The pool can only go after every file handle using it is closed
+    if (NULL != HTS_POOL.pool) {
+        hts_tpool_destroy(HTS_POOL.pool);
+        HTS_POOL.pool = NULL;
     }
 
     // Free temporary read
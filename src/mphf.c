@@ -0,0 +1,160 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+#include <stdlib.h>
+#include <string.h>
+#include "mphf.h"
+#include "thread_pool.h"
+#include "utils.h"
+
+// Levels are padded to whole rank blocks so ranks never straddle two levels
+#define MPHF_BLOCK_BITS 512
+// Fewer keys than this are not worth handing to threads
+#define MPHF_MIN_PARALLEL 65536
+
+static inline uint64_t mphf_hash(uint64_t key, uint8_t level) {
+    // splitmix64 finalizer with a different offset for every level
+    uint64_t h = key + 0x9e3779b97f4a7c15ULL * (uint64_t) (level + 1);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static inline uint64_t mphf_pos(uint64_t key, uint8_t level, uint64_t size) {
+    // Maps the hash onto [0, size) with a multiplication instead of a modulo
+    return (uint64_t) (((unsigned __int128) mphf_hash(key, level) * size) >> 64);
+}
+
+typedef struct {
+    const uint64_t *keys;
+    uint64_t beg;
+    uint64_t end;
+    uint64_t *seen;
+    uint64_t *collided;
+    uint64_t size;
+    uint8_t level;
+} mphf_arg_t;
+
+static void mark_keys(void *args_void) {
+    // Set the bit of every key in a level, flagging bits set more than once
+    mphf_arg_t *args = (mphf_arg_t *) args_void;
+    for (uint64_t i = args->beg; i < args->end; i++) {
+        uint64_t pos = mphf_pos(args->keys[i], args->level, args->size);
+        uint64_t mask = (uint64_t) 1 << (pos & 63);
+        if (__atomic_fetch_or(&args->seen[pos >> 6], mask, __ATOMIC_RELAXED) & mask) {
+            __atomic_fetch_or(&args->collided[pos >> 6], mask, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+mphf_t *mphf_build(const uint64_t *keys, uint64_t n_keys, double gamma, int64_t n_threads) {
+    /**
+     * @abstract Build a minimal perfect hash.
+     * @keys Keys to hash; duplicates (and keys still colliding after MPHF_MAX_LEVELS levels)
+     * are left without an index, i.e., mphf_lookup() returns -1 for them
+     * @gamma Bits per remaining key in every level (larger is faster to build and query)
+     * @n_threads Threads for marking keys in large levels
+     * @returns The hash; NULL on failure
+     */
+    tpool_t *tp = NULL;
+    uint64_t *collided = NULL;
+    mphf_t *mphf = calloc(1, sizeof(mphf_t));
+    uint64_t *rest = malloc((n_keys > 0 ? n_keys : 1) * sizeof(uint64_t));
+    if (NULL == mphf || NULL == rest) goto fail;
+    memcpy(rest, keys, n_keys * sizeof(uint64_t));
+
+    if (n_threads > 1 && n_keys >= MPHF_MIN_PARALLEL) tp = tpool_create(n_threads, n_threads);
+
+    uint64_t n_rest = n_keys;
+    while (n_rest > 0 && mphf->n_levels < MPHF_MAX_LEVELS) {
+        uint8_t level = mphf->n_levels;
+        uint64_t size = (uint64_t) (gamma * (double) n_rest) + 1;
+        size = (size + MPHF_BLOCK_BITS - 1) / MPHF_BLOCK_BITS * MPHF_BLOCK_BITS;
+        uint64_t off = mphf->level_off[level];
+        uint64_t *bits = realloc(mphf->bits, (off + size) / 64 * sizeof(uint64_t));
+        collided = calloc(size / 64, sizeof(uint64_t));
+        if (NULL == bits || NULL == collided) {
+            if (NULL != bits) mphf->bits = bits;
+            goto fail_level;
+        }
+        mphf->bits = bits;
+        uint64_t *seen = mphf->bits + off / 64;
+        memset(seen, 0, size / 64 * sizeof(uint64_t));
+
+        if (NULL != tp && n_rest >= MPHF_MIN_PARALLEL) {
+            uint64_t step = (n_rest + n_threads - 1) / n_threads;
+            for (uint64_t beg = 0; beg < n_rest; beg += step) {
+                mphf_arg_t args = {rest, beg, beg + step < n_rest ? beg + step : n_rest, seen, collided, size, level};
+                tpool_add_work(tp, mark_keys, &args, sizeof(mphf_arg_t));
+            }
+            tpool_wait(tp);
+        } else {
+            mphf_arg_t args = {rest, 0, n_rest, seen, collided, size, level};
+            mark_keys(&args);
+        }
+
+        // Bits of colliding keys are cleared and those keys go on to the next level
+        for (uint64_t w = 0; w < size / 64; w++) seen[w] &= ~collided[w];
+        uint64_t n_next = 0;
+        for (uint64_t i = 0; i < n_rest; i++) {
+            uint64_t pos = mphf_pos(rest[i], level, size);
+            if (collided[pos >> 6] >> (pos & 63) & 1) rest[n_next++] = rest[i];
+        }
+        free(collided);
+        collided = NULL;
+        n_rest = n_next;
+        mphf->level_off[level + 1] = off + size;
+        mphf->n_levels++;
+    }
+    if (NULL != tp) tpool_destroy(tp);
+    tp = NULL;
+    free(rest);
+    rest = NULL;
+
+    uint64_t n_blocks = mphf->level_off[mphf->n_levels] / MPHF_BLOCK_BITS;
+    mphf->ranks = malloc((n_blocks + 1) * sizeof(uint64_t));
+    if (NULL == mphf->ranks) goto fail;
+    uint64_t n_set = 0;
+    for (uint64_t b = 0; b < n_blocks; b++) {
+        mphf->ranks[b] = n_set;
+        for (uint64_t w = b * 8; w < b * 8 + 8; w++) n_set += __builtin_popcountll(mphf->bits[w]);
+    }
+    mphf->ranks[n_blocks] = n_set;
+    mphf->n_placed = n_set;
+    return mphf;
+
+    fail_level:
+    free(collided);
+    fail:
+    if (NULL != tp) tpool_destroy(tp);
+    log_msg("Fail to allocate memory for the minimal perfect hash", ERROR);
+    free(rest);
+    mphf_destroy(mphf);
+    return NULL;
+}
+
+int64_t mphf_lookup(const mphf_t *mphf, uint64_t key) {
+    /**
+     * @abstract Get the index of a key. Keys that were not in the build get an arbitrary
+     * index or -1, so the caller has to verify the key stored at that index.
+     * @returns An index from 0 to n_placed - 1; -1 if the key has none
+     */
+    for (uint8_t level = 0; level < mphf->n_levels; level++) {
+        uint64_t off = mphf->level_off[level];
+        uint64_t pos = off + mphf_pos(key, level, mphf->level_off[level + 1] - off);
+        uint64_t word = mphf->bits[pos >> 6];
+        if (!(word >> (pos & 63) & 1)) continue;
+
+        uint64_t rank = mphf->ranks[pos / MPHF_BLOCK_BITS];
+        for (uint64_t w = pos / MPHF_BLOCK_BITS * 8; w < pos >> 6; w++) rank += __builtin_popcountll(mphf->bits[w]);
+        return (int64_t) (rank + __builtin_popcountll(word & (((uint64_t) 1 << (pos & 63)) - 1)));
+    }
+    return -1;
+}
+
+void mphf_destroy(mphf_t *mphf) {
+    if (NULL == mphf) return;
+    free(mphf->bits);
+    free(mphf->ranks);
+    free(mphf);
+}
@@ -0,0 +1,26 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+
+#ifndef SCBAMSPLIT_MPHF_H
+#define SCBAMSPLIT_MPHF_H
+#include <stdint.h>
+
+#define MPHF_MAX_LEVELS 32
+
+// Minimal perfect hash over distinct 64-bit keys (BBHash): every level is a bit array in which
+// keys that land alone set their bit, and colliding keys move on to the next level. A key's
+// index is the number of set bits before its own bit.
+typedef struct {
+    uint64_t *bits;                            // Bit arrays of all levels, concatenated
+    uint64_t *ranks;                           // Set bits before every 512-bit block
+    uint64_t level_off[MPHF_MAX_LEVELS + 1];   // First bit of every level (and the end of the last)
+    uint8_t n_levels;
+    uint64_t n_placed;                         // Keys that got an index (0 to n_placed - 1)
+} mphf_t;
+
+mphf_t *mphf_build(const uint64_t *keys, uint64_t n_keys, double gamma, int64_t n_threads);
+int64_t mphf_lookup(const mphf_t *mphf, uint64_t key);
+void mphf_destroy(mphf_t *mphf);
+
+#endif //SCBAMSPLIT_MPHF_H
@@ -0,0 +1,223 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+#include <stdlib.h>
+#include <string.h>
+#include "pipeline.h"
+#include "rawbam.h"
+#include "thread_pool.h"
+
+typedef struct {
+    split_pipe_t *pipe;
+    uint32_t id;               /* writer number (writers only) */
+} pipe_arg_t;
+
+static void classify_batches(void *args_void) {
+    // Worker: look up the labels of batches in the order they were read
+    split_pipe_t *pipe = ((pipe_arg_t *) args_void)->pipe;
+    cb_run_t run;
+    cb_run_init(&run, pipe->bct, false);
+    tag_view_t cb_view;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (true) {
+        split_batch_t *batch = &pipe->batches[pipe->next_classify % pipe->n_batches];
+        if (pipe->eof && pipe->next_classify == pipe->n_read) break;
+        if (pipe->next_classify == pipe->n_read || batch->state != BATCH_FILLED) {
+            pthread_cond_wait(&pipe->changed, &pipe->lock);
+            continue;
+        }
+        pipe->next_classify++;
+        pthread_mutex_unlock(&pipe->lock);
+
+        for (int32_t i = 0; i < batch->n; i++) {
+            bam1_t *read = NULL != batch->raws ? &batch->raws[i]->view : batch->reads[i];
+            batch->vals[i] = label_of_read(read, pipe->bct, pipe->cb_meta, pipe->ub_meta, pipe->qthres,
+                                           &cb_view, &run);
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        batch->state = BATCH_CLASSIFIED;
+        batch->writers_left = pipe->n_writers;
+        pthread_cond_broadcast(&pipe->changed);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    cb_run_destroy(&run);
+}
+
+static int8_t write_owned(split_pipe_t *pipe, split_batch_t *batch, uint32_t id) {
+    // Write the records of a batch that go to labels owned by a writer
+    for (int32_t i = 0; i < batch->n; i++) {
+        if (batch->vals[i] < 0) continue;
+        uint32_t lval = (uint32_t) batch->vals[i];
+        const uint32_t *lids;
+        uint32_t n_lids = label_ids(pipe->labels, &lval, &lids);
+        for (uint32_t j = 0; j < n_lids; j++) {
+            if (lids[j] % pipe->n_writers != id) continue;
+            label2fp *fout = pipe->labels->by_id[lids[j]];
+            if (NULL == fout->fp) continue;
+            int write_stat = NULL != batch->raws ? raw_write1(fout->fp->fp.bgzf, batch->raws[i]) :
+                             sam_write1(fout->fp, pipe->header, batch->reads[i]);
+            if (write_stat < 0) {
+                log_msg("Fail to write reads to individual BAM file (%s)", ERROR, fout->label);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void write_batches(void *args_void) {
+    // Writer: write batches in input order, so the records of every label keep their order
+    split_pipe_t *pipe = ((pipe_arg_t *) args_void)->pipe;
+    uint32_t id = ((pipe_arg_t *) args_void)->id;
+    bool failed = false;
+
+    pthread_mutex_lock(&pipe->lock);
+    for (int64_t seq = 0; ; ) {
+        split_batch_t *batch = &pipe->batches[seq % pipe->n_batches];
+        if (pipe->eof && seq == pipe->n_read) break;
+        if (batch->seq != seq || batch->state != BATCH_CLASSIFIED) {
+            pthread_cond_wait(&pipe->changed, &pipe->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pipe->lock);
+
+        // After a failure, batches are still passed on so the other stages can finish
+        if (!failed && 0 != write_owned(pipe, batch, id)) failed = true;
+
+        pthread_mutex_lock(&pipe->lock);
+        if (failed) pipe->err = 1;
+        if (0 == --batch->writers_left) {
+            batch->state = BATCH_FREE;
+            pthread_cond_broadcast(&pipe->changed);
+        }
+        seq++;
+    }
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+static int fill_batch(samFile *fp, sam_hdr_t *header, split_batch_t *batch) {
+    // Read up to PIPE_BATCH_SIZE records; returns the status of the last read (as sam_read1())
+    int read_stat = 0;
+    for (batch->n = 0; batch->n < PIPE_BATCH_SIZE; batch->n++) {
+        read_stat = NULL != batch->raws ? raw_read1(fp->fp.bgzf, batch->raws[batch->n]) :
+                    sam_read1(fp, header, batch->reads[batch->n]);
+        if (read_stat < 0) break;
+    }
+    return read_stat;
+}
+
+static void destroy_batches(split_pipe_t *pipe) {
+    for (uint32_t b = 0; b < pipe->n_batches; b++) {
+        split_batch_t *batch = &pipe->batches[b];
+        for (int32_t i = 0; i < PIPE_BATCH_SIZE; i++) {
+            if (NULL != batch->raws) raw_read_destroy(batch->raws[i]);
+            if (NULL != batch->reads && NULL != batch->reads[i]) bam_destroy1(batch->reads[i]);
+        }
+        free(batch->raws);
+        free(batch->reads);
+        free(batch->vals);
+    }
+    free(pipe->batches);
+}
+
+static int8_t init_batches(split_pipe_t *pipe, bool raw) {
+    pipe->batches = calloc(pipe->n_batches, sizeof(split_batch_t));
+    if (NULL == pipe->batches) return 1;
+    for (uint32_t b = 0; b < pipe->n_batches; b++) {
+        split_batch_t *batch = &pipe->batches[b];
+        batch->seq = -1;
+        batch->vals = malloc(PIPE_BATCH_SIZE * sizeof(int64_t));
+        if (raw) {
+            batch->raws = calloc(PIPE_BATCH_SIZE, sizeof(raw_read_t *));
+        } else {
+            batch->reads = calloc(PIPE_BATCH_SIZE, sizeof(bam1_t *));
+        }
+        if (NULL == batch->vals || (NULL == batch->raws && NULL == batch->reads)) return 1;
+        for (int32_t i = 0; i < PIPE_BATCH_SIZE; i++) {
+            if (raw && NULL == (batch->raws[i] = raw_read_init())) return 1;
+            if (!raw && NULL == (batch->reads[i] = bam_init1())) return 1;
+        }
+    }
+    return 0;
+}
+
+int8_t pipeline_split(samFile *fp, sam_hdr_t *header, bctable_t *bct, label_set_t *labels, int64_t qthres,
+                      tag_meta_t *cb_meta, tag_meta_t *ub_meta, int64_t n_threads) {
+    /**
+     * @abstract Split an input that cannot be read in parallel (e.g., a stream or a SAM/CRAM file)
+     * without deduplication: this thread reads batches of records, worker threads look their
+     * labels up, and writer threads write them, each to the outputs of its own labels.
+     * @fp The input opened in main() with its header already read
+     * @n_threads Threads for the workers and writers, besides this one (the share of -@ the htslib
+     * pool leaves, see main())
+     * @returns 0 on success; 1 on error; -1 if there are too few threads for a pipeline
+     */
+    if (n_threads < 2) return -1;
+
+    split_pipe_t pipe = {
+            .n_workers = (uint32_t) (n_threads / 2),
+            .n_writers = (uint32_t) (n_threads - n_threads / 2),
+            .header = header,
+            .bct = bct,
+            .labels = labels,
+            .qthres = qthres,
+            .cb_meta = cb_meta,
+            .ub_meta = ub_meta,
+    };
+    // Enough batches in flight for every thread to have one and the reader to keep going
+    pipe.n_batches = 2 * (pipe.n_workers + pipe.n_writers);
+    bool raw = raw_supported(fp);
+    if (0 != init_batches(&pipe, raw)) {
+        log_msg("Fail to allocate read batches", ERROR);
+        if (NULL != pipe.batches) destroy_batches(&pipe);
+        return 1;
+    }
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.changed, NULL);
+    log_msg("Splitting with %u threads looking up labels and %u threads writing", INFO,
+            pipe.n_workers, pipe.n_writers);
+
+    tpool_t *pipe_tp = tpool_create(pipe.n_workers + pipe.n_writers, pipe.n_workers + pipe.n_writers);
+    for (uint32_t i = 0; i < pipe.n_workers; i++) {
+        pipe_arg_t args = {.pipe = &pipe};
+        tpool_add_work(pipe_tp, classify_batches, &args, sizeof(pipe_arg_t));
+    }
+    for (uint32_t i = 0; i < pipe.n_writers; i++) {
+        pipe_arg_t args = {.pipe = &pipe, .id = i};
+        tpool_add_work(pipe_tp, write_batches, &args, sizeof(pipe_arg_t));
+    }
+
+    int read_stat = 0;
+    pthread_mutex_lock(&pipe.lock);
+    while (read_stat >= 0 && 0 == pipe.err) {
+        split_batch_t *batch = &pipe.batches[pipe.n_read % pipe.n_batches];
+        if (BATCH_FREE != batch->state) {
+            pthread_cond_wait(&pipe.changed, &pipe.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pipe.lock);
+        read_stat = fill_batch(fp, header, batch);
+        pthread_mutex_lock(&pipe.lock);
+        if (0 == batch->n) break;
+        batch->seq = pipe.n_read++;
+        batch->state = BATCH_FILLED;
+        pthread_cond_broadcast(&pipe.changed);
+    }
+    pipe.eof = true;
+    pthread_cond_broadcast(&pipe.changed);
+    pthread_mutex_unlock(&pipe.lock);
+
+    tpool_wait(pipe_tp);
+    tpool_destroy(pipe_tp);
+    int8_t return_val = pipe.err;
+    if (read_stat < -1) {
+        log_msg("Fail to read the input BAM file (truncated or corrupted?)", ERROR);
+        return_val = 1;
+    }
+    pthread_cond_destroy(&pipe.changed);
+    pthread_mutex_destroy(&pipe.lock);
+    destroy_batches(&pipe);
+    return return_val;
+}
@@ -0,0 +1,59 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+
+#ifndef SCBAMSPLIT_PIPELINE_H
+#define SCBAMSPLIT_PIPELINE_H
+#include <stdbool.h>
+#include <pthread.h>
+#include "htslib/sam.h"
+#include "hash.h"
+#include "utils.h"
+
+// Records per batch passed between the stages of the split pipeline
+#define PIPE_BATCH_SIZE 2048
+
+enum batch_state {
+    BATCH_FREE,                /* waiting to be filled by the reader */
+    BATCH_FILLED,              /* read; waiting for a worker to look its labels up */
+    BATCH_CLASSIFIED           /* labels known; being written by the writers */
+};
+
+// A batch of records in input order with the label value of each (see bctable_find())
+typedef struct {
+    enum batch_state state;
+    int64_t seq;               /* number of the batch in the input */
+    int32_t n;
+    bam1_t **reads;            /* with non-BAM input */
+    raw_read_t **raws;         /* with BAM input, passed through as raw bytes */
+    int64_t *vals;
+    uint32_t writers_left;     /* writers yet to write this batch */
+} split_batch_t;
+
+// Reader -> workers -> writers: the reader (the calling thread) fills batches, workers look the
+// labels of whole batches up, and every writer writes the labels it owns (label ID % n_writers)
+// batch by batch in input order, so no output is shared between threads and records of a label
+// keep their input order.
+typedef struct {
+    split_batch_t *batches;    /* ring of batches; batch seq is in slot seq % n_batches */
+    uint32_t n_batches;
+    uint32_t n_workers;
+    uint32_t n_writers;
+    int64_t next_classify;     /* next batch for a worker */
+    int64_t n_read;            /* batches filled so far */
+    bool eof;                  /* set once n_read is final */
+    int8_t err;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    sam_hdr_t *header;
+    bctable_t *bct;
+    label_set_t *labels;
+    int64_t qthres;
+    tag_meta_t *cb_meta;
+    tag_meta_t *ub_meta;
+} split_pipe_t;
+
+int8_t pipeline_split(samFile *fp, sam_hdr_t *header, bctable_t *bct, label_set_t *labels, int64_t qthres,
+                      tag_meta_t *cb_meta, tag_meta_t *ub_meta, int64_t n_threads);
+
+#endif //SCBAMSPLIT_PIPELINE_H
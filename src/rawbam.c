@@ -0,0 +1,95 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+#include <stdlib.h>
+#include <string.h>
+#include "htslib/hts_endian.h"
+#include "rawbam.h"
+
+raw_read_t *raw_read_init() {
+    raw_read_t *rr;
+    rr = calloc(1, sizeof(raw_read_t));
+    if (NULL == rr) return NULL;
+    rr->cap = 1024;
+    rr->data = malloc(rr->cap);
+    if (NULL == rr->data) {
+        free(rr);
+        return NULL;
+    }
+    return rr;
+}
+
+void raw_read_destroy(raw_read_t *rr) {
+    if (NULL == rr) return;
+    free(rr->data);
+    free(rr);
+}
+
+bool raw_supported(samFile *fp) {
+    /**
+     * @abstract Check if records of an input can be passed through as raw bytes: it has to be a
+     * BAM file, and the bam1_t view relies on a little-endian host (as the BAM format is).
+     */
+    return fp->format.format == bam && !ed_is_big();
+}
+
+int raw_read1(BGZF *fp, raw_read_t *rr) {
+    /**
+     * @abstract Read the next BAM record as raw bytes and point rr->view at them.
+     * @fp The BGZF handle of a BAM file positioned at a record (e.g., after the header is read)
+     * @rr A record buffer from raw_read_init()
+     * @returns The size of the record on success; -1 on EOF; < -1 on truncated or corrupted input
+     */
+    uint8_t size_buf[4];
+    ssize_t got = bgzf_read(fp, size_buf, 4);
+    if (0 == got) return -1;
+    if (4 != got) return -2;
+
+    uint32_t block_size = le_to_u32(size_buf);
+    if (block_size < 32 || block_size > (1U << 30)) return -4;
+    uint32_t len = block_size + 4;
+    if (len > rr->cap) {
+        uint32_t new_cap = rr->cap;
+        while (new_cap < len) new_cap *= 2;
+        uint8_t *new_data = realloc(rr->data, new_cap);
+        if (NULL == new_data) return -4;
+        rr->data = new_data;
+        rr->cap = new_cap;
+    }
+    memcpy(rr->data, size_buf, 4);
+    if (bgzf_read(fp, rr->data + 4, block_size) != (ssize_t) block_size) return -3;
+    rr->len = len;
+
+    // Fixed-length fields follow the BAM specification (section 4.2)
+    const uint8_t *x = rr->data + 4;
+    bam1_core_t *c = &rr->view.core;
+    c->tid = le_to_i32(x);
+    c->pos = le_to_i32(x + 4);
+    c->l_qname = x[8];
+    c->qual = x[9];
+    c->bin = le_to_u16(x + 10);
+    c->n_cigar = le_to_u16(x + 12);
+    c->flag = le_to_u16(x + 14);
+    c->l_qseq = le_to_i32(x + 16);
+    c->mtid = le_to_i32(x + 20);
+    c->mpos = le_to_i32(x + 24);
+    c->isize = le_to_i32(x + 28);
+    c->l_extranul = 0;
+
+    if (c->l_qname < 1 || c->l_qseq < 0 ||
+        (int64_t) 32 + c->l_qname + 4 * (int64_t) c->n_cigar + (c->l_qseq + 1) / 2 + c->l_qseq > block_size) {
+        return -4;
+    }
+    rr->view.data = rr->data + 36;
+    rr->view.l_data = (int) block_size - 32;
+    rr->view.m_data = block_size - 32;
+    return (int) len;
+}
+
+int raw_write1(BGZF *fp, const raw_read_t *rr) {
+    /**
+     * @abstract Append a raw record to a BAM output as is.
+     * @returns 0 on success; -1 on error
+     */
+    return bgzf_write(fp, rr->data, rr->len) == (ssize_t) rr->len ? 0 : -1;
+}
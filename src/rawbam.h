@@ -0,0 +1,27 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+
+#ifndef SCBAMSPLIT_RAWBAM_H
+#define SCBAMSPLIT_RAWBAM_H
+#include <stdbool.h>
+#include "htslib/sam.h"
+
+// A BAM record kept as the bytes found in the file (block_size included), so it can be
+// written out again without being decoded into a bam1_t and encoded back.
+typedef struct {
+    uint8_t *data;
+    uint32_t len;
+    uint32_t cap;
+    // A bam1_t whose data points into the raw bytes for read-only htslib calls
+    // (e.g., bam_aux_get()); it does not own memory and must not be given to bam_destroy1()
+    bam1_t view;
+} raw_read_t;
+
+raw_read_t *raw_read_init();
+void raw_read_destroy(raw_read_t *rr);
+bool raw_supported(samFile *fp);
+int raw_read1(BGZF *fp, raw_read_t *rr);
+int raw_write1(BGZF *fp, const raw_read_t *rr);
+
+#endif //SCBAMSPLIT_RAWBAM_H
@@ -0,0 +1,1055 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include "shard.h"
+#include "sort.h"
+#include "thread_pool.h"
+#include "spill.h"
+#include "htslib/hts_endian.h"
+
+// The 28-byte empty block that terminates every BGZF file
+static const uint8_t BGZF_EOF_BLOCK[28] = {
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+        0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static void close_shard(shard_t *shards, int64_t *n_shards,
+                        int32_t tid_beg, hts_pos_t pos_beg, int32_t tid_end, hts_pos_t pos_end) {
+    shard_t *s = &shards[*n_shards];
+    memset(s, 0, sizeof(shard_t));
+    s->tid_beg = tid_beg;
+    s->pos_beg = pos_beg;
+    s->tid_end = tid_end;
+    s->pos_end = pos_end;
+    s->sid = *n_shards;
+    (*n_shards)++;
+}
+
+shard_t *plan_region_shards(sam_hdr_t *header, hts_idx_t *idx, int64_t n_target, int64_t *n_shards) {
+    /**
+     * @abstract Cut the genome into about n_target ranges holding similar numbers of reads.
+     * Read counts come from the index; contig lengths are used when the index has no statistics.
+     * Small contigs are lumped together, large ones are cut proportionally to their length.
+     * Reads without coordinates get a shard of their own at the end.
+     * @header Header of the indexed BAM file
+     * @idx The index loaded by sam_index_load()
+     * @n_target The number of shards to aim for
+     * @n_shards Returns the number of shards planned
+     * @returns An array of shards (free with destroy_shards()); NULL on error
+     */
+    int32_t n_ref = header->n_targets;
+    *n_shards = 0;
+    if (n_target < 1) n_target = 1;
+
+    uint64_t *weight = calloc(n_ref > 0 ? n_ref : 1, sizeof(uint64_t));
+    if (NULL == weight) return NULL;
+
+    uint64_t total = 0;
+    bool by_length = false;
+    for (int32_t tid = 0; tid < n_ref; tid++) {
+        uint64_t mapped = 0, unmapped = 0;
+        if (hts_idx_get_stat(idx, tid, &mapped, &unmapped) < 0) {
+            by_length = true;
+            break;
+        }
+        weight[tid] = mapped + unmapped;
+        total += weight[tid];
+    }
+    if (by_length || 0 == total) {
+        total = 0;
+        for (int32_t tid = 0; tid < n_ref; tid++) {
+            weight[tid] = header->target_len[tid];
+            total += weight[tid];
+        }
+    }
+
+    // Every closed shard holds at least per_shard reads, so there are at most n_target + 2 shards
+    shard_t *shards = calloc(n_target + 2, sizeof(shard_t));
+    if (NULL == shards) {
+        free(weight);
+        return NULL;
+    }
+
+    uint64_t per_shard = total / n_target + 1;
+    uint64_t acc = 0;
+    int32_t tid_beg = 0;
+    hts_pos_t pos_beg = 0;
+    for (int32_t tid = 0; tid < n_ref; tid++) {
+        hts_pos_t len = header->target_len[tid];
+        hts_pos_t pos = 0;
+        uint64_t remaining = weight[tid];
+
+        while (acc + remaining >= per_shard && remaining > 0) {
+            uint64_t need = per_shard - acc;
+            hts_pos_t cut = pos + (hts_pos_t) ((double) (len - pos) * need / remaining);
+            if (cut <= pos) cut = pos + 1;
+            if (cut >= len) {
+                // The rest of this contig completes the shard
+                close_shard(shards, n_shards, tid_beg, pos_beg, tid, HTS_POS_MAX);
+                tid_beg = tid + 1;
+                pos_beg = 0;
+                remaining = 0;
+                acc = 0;
+                break;
+            }
+            close_shard(shards, n_shards, tid_beg, pos_beg, tid, cut);
+            tid_beg = tid;
+            pos_beg = cut;
+            remaining -= need;
+            pos = cut;
+            acc = 0;
+        }
+        acc += remaining;
+    }
+    if (tid_beg < n_ref) {
+        close_shard(shards, n_shards, tid_beg, pos_beg, n_ref - 1, HTS_POS_MAX);
+    }
+
+    // Unmapped reads without a placed mate are only reachable through HTS_IDX_NOCOORD
+    close_shard(shards, n_shards, HTS_IDX_NOCOORD, 0, HTS_IDX_NOCOORD, 0);
+
+    free(weight);
+    return shards;
+}
+
+static bool valid_record_chain(const uint8_t *buf, int64_t len, int32_t n_ref) {
+    /**
+     * @abstract Check whether buf starts with a run of well-formed BAM records that covers the
+     * whole window (the last record may be cut off by the window end).
+     * @returns true if at least two complete records are found and nothing looks off
+     */
+    int64_t offset = 0;
+    int32_t n_complete = 0;
+    while (len - offset >= 36) {
+        const uint8_t *r = buf + offset;
+        int32_t block_size = le_to_i32(r);
+        int32_t ref_id = le_to_i32(r + 4);
+        int32_t pos = le_to_i32(r + 8);
+        uint8_t l_read_name = r[12];
+        uint16_t n_cigar = le_to_u16(r + 16);
+        int32_t l_seq = le_to_i32(r + 20);
+        int32_t next_ref_id = le_to_i32(r + 24);
+        int32_t next_pos = le_to_i32(r + 28);
+
+        if (block_size < 32 || block_size > (1 << 24)) return false;
+        if (ref_id < -1 || ref_id >= n_ref || next_ref_id < -1 || next_ref_id >= n_ref) return false;
+        if (pos < -1 || next_pos < -1 || l_read_name < 1 || l_seq < 0) return false;
+        if ((int64_t) 32 + l_read_name + 4 * (int64_t) n_cigar + (l_seq + 1) / 2 + l_seq > block_size) {
+            return false;
+        }
+
+        // The read name must be printable and NUL-terminated (only checked if it is in the window)
+        if (offset + 36 + l_read_name <= len) {
+            const uint8_t *name = r + 36;
+            if (name[l_read_name - 1] != '\0') return false;
+            for (int32_t i = 0; i < l_read_name - 1; i++) {
+                if (name[i] < '!' || name[i] > '~') return false;
+            }
+        }
+
+        if (offset + 4 + block_size > len) break;
+        offset += 4 + block_size;
+        n_complete++;
+    }
+    return n_complete >= 2;
+}
+
+static int64_t find_block(FILE *bam, int64_t from, int64_t file_size) {
+    // Look for the next BGZF block header at or after a byte position
+    uint8_t magic[16];
+    uint8_t window[1 << 16];
+    int64_t pos = from;
+    while (pos + 18 <= file_size) {
+        if (0 != fseek(bam, pos, SEEK_SET)) return -1;
+        size_t got = fread(window, 1, sizeof(window), bam);
+        if (got < 18) return -1;
+        for (size_t i = 0; i + 18 <= got; i++) {
+            if (window[i] != 0x1f || window[i + 1] != 0x8b || window[i + 2] != 0x08 || window[i + 3] != 0x04) {
+                continue;
+            }
+            memcpy(magic, window + i + 10, 6);
+            if (magic[0] == 6 && magic[1] == 0 && magic[2] == 'B' && magic[3] == 'C' &&
+                magic[4] == 2 && magic[5] == 0) {
+                return pos + (int64_t) i;
+            }
+        }
+        pos += (int64_t) got - 17;
+    }
+    return -1;
+}
+
+static int64_t find_record_start(const char *bampath, FILE *bam, int64_t from, int64_t file_size, int32_t n_ref) {
+    /**
+     * @abstract Find the virtual offset of the first BAM record that starts in a block at or
+     * after a byte position.
+     * @returns A virtual offset; -1 if no record starts after the position
+     */
+    int64_t window_size = 1 << 18;
+    uint8_t *window = malloc(window_size);
+    int64_t coffset = from;
+    int64_t voffset = -1;
+
+    while (-1 == voffset && -1 != (coffset = find_block(bam, coffset, file_size))) {
+        // A fresh handle for each candidate: a false block header leaves the old one in an error state
+        BGZF *bfp = bgzf_open(bampath, "r");
+        if (NULL == bfp) break;
+        // An empty block (e.g., a flush block) is skipped by bgzf_read(), which then reads the next
+        // block; that block is found as a candidate of its own
+        if (bgzf_seek(bfp, coffset << 16, SEEK_SET) < 0 || bgzf_read(bfp, window, 1) != 1 ||
+            bgzf_tell(bfp) >> 16 != coffset) {
+            bgzf_close(bfp);
+            coffset++;
+            continue;
+        }
+        int32_t block_length = bfp->block_length;
+        ssize_t got = bgzf_read(bfp, window + 1, window_size - 1);
+        bgzf_close(bfp);
+        if (got < 0) {
+            coffset++;
+            continue;
+        }
+        got += 1;
+
+        // A record has to start in this block for the offset to be addressable from it
+        for (int32_t u = 0; u < block_length && u < got; u++) {
+            if (valid_record_chain(window + u, got - u, n_ref)) {
+                voffset = (coffset << 16) | u;
+                break;
+            }
+        }
+        coffset++;
+    }
+    free(window);
+    return voffset;
+}
+
+shard_t *plan_block_shards(const char *bampath, int64_t first_voff, int32_t n_ref, int64_t n_target,
+                           int64_t *n_shards) {
+    /**
+     * @abstract Cut an unindexed BAM file into byte ranges of similar size that start at record
+     * boundaries found by scanning BGZF block headers.
+     * @bampath Path to the BAM file
+     * @first_voff Virtual offset of the first record (right after the header)
+     * @n_ref Number of reference sequences in the header (used to validate records)
+     * @n_target The number of shards to aim for
+     * @n_shards Returns the number of shards planned
+     * @returns An array of shards (free with destroy_shards()); NULL on error
+     */
+    *n_shards = 0;
+    if (n_target < 1) n_target = 1;
+
+    FILE *bam = fopen(bampath, "rb");
+    if (NULL == bam) return NULL;
+    struct stat st = {0};
+    if (0 != fstat(fileno(bam), &st)) {
+        fclose(bam);
+        return NULL;
+    }
+
+    shard_t *shards = calloc(n_target, sizeof(shard_t));
+    if (NULL == shards) {
+        fclose(bam);
+        return NULL;
+    }
+
+    int64_t voff_beg = first_voff;
+    int64_t first_block = first_voff >> 16;
+    for (int64_t i = 1; i <= n_target; i++) {
+        int64_t voff_end = -1;
+        if (i < n_target) {
+            int64_t approx = st.st_size * i / n_target;
+            if (approx > first_block) voff_end = find_record_start(bampath, bam, approx, st.st_size, n_ref);
+            // Skip cuts that land before the previous one (e.g., within a single huge block)
+            if (voff_end != -1 && voff_end <= voff_beg) continue;
+        }
+
+        shard_t *s = &shards[*n_shards];
+        s->by_offset = true;
+        s->voff_beg = voff_beg;
+        s->voff_end = voff_end;
+        s->sid = *n_shards;
+        (*n_shards)++;
+        if (-1 == voff_end) break;
+        voff_beg = voff_end;
+    }
+    fclose(bam);
+    return shards;
+}
+
+int8_t shard_reader_init(shard_reader_t *sr, samFile *fp, hts_idx_t *idx, shard_t *shards, int64_t n_shards) {
+    /**
+     * @abstract Prepare to read the records of several shards in order through one file handle.
+     * @fp A handle to the input whose header has been read
+     * @idx The index of the input (only needed for genomic ranges)
+     * @returns 0 on success
+     */
+    memset(sr, 0, sizeof(shard_reader_t));
+    sr->fp = fp;
+    sr->header = fp->bam_header;
+    sr->idx = idx;
+    sr->shards = shards;
+    sr->n_shards = n_shards;
+    return 0;
+}
+
+int shard_read1(shard_reader_t *sr, bam1_t *read) {
+    /**
+     * @abstract Read the next record of the shards given to shard_reader_init().
+     * @returns >= 0 on success; -1 when all shards are read; < -1 on error.
+     * The shard the record belongs to is sr->shards[sr->cur].
+     */
+    int ret;
+    while (sr->cur < sr->n_shards) {
+        shard_t *s = &sr->shards[sr->cur];
+        if (!sr->started) {
+            sr->started = true;
+            sr->tid = s->tid_beg;
+            if (s->by_offset && bgzf_seek(sr->fp->fp.bgzf, s->voff_beg, SEEK_SET) < 0) {
+                log_msg("Fail to seek to shard #%u", ERROR, s->sid);
+                return -2;
+            }
+        }
+
+        if (s->by_offset) {
+            if (s->voff_end < 0 || bgzf_tell(sr->fp->fp.bgzf) < s->voff_end) {
+                ret = sam_read1(sr->fp, sr->header, read);
+                if (ret != -1) return ret;
+            }
+        } else {
+            while (sr->tid <= s->tid_end) {
+                if (NULL == sr->itr) {
+                    sr->beg = sr->tid == s->tid_beg ? s->pos_beg : 0;
+                    hts_pos_t end = sr->tid == s->tid_end ? s->pos_end : HTS_POS_MAX;
+                    if (sr->tid != HTS_IDX_NOCOORD && sr->beg >= end) {
+                        sr->tid++;
+                        continue;
+                    }
+                    sr->itr = sam_itr_queryi(sr->idx, sr->tid, sr->beg, end);
+                    if (NULL == sr->itr) {
+                        log_msg("Fail to query region %d:%" PRId64 "-%" PRId64, ERROR, sr->tid, sr->beg, end);
+                        return -2;
+                    }
+                }
+                while (0 <= (ret = sam_itr_next(sr->fp, sr->itr, read))) {
+                    // Reads that start before the range belong to the previous shard
+                    if (sr->tid != HTS_IDX_NOCOORD && read->core.pos < sr->beg) continue;
+                    return ret;
+                }
+                hts_itr_destroy(sr->itr);
+                sr->itr = NULL;
+                if (ret < -1) return ret;
+                sr->tid++;
+            }
+        }
+        sr->cur++;
+        sr->started = false;
+    }
+    return -1;
+}
+
+void shard_reader_destroy(shard_reader_t *sr) {
+    if (NULL != sr->itr) hts_itr_destroy(sr->itr);
+    sr->itr = NULL;
+}
+
+BGZF *bgzf_reopen(const char *path, const char *mode) {
+    /**
+     * @abstract Reopen a closed BGZF file to append to it, without the EOF block bgzf_close()
+     * left at its end, so the file stays free of empty blocks until it is closed again.
+     * @mode The mode the file was created with (e.g., OUT_MODE), whose level is kept
+     * @returns The handle; NULL on failure
+     */
+    struct stat st = {0};
+    if (0 != stat(path, &st)) return NULL;
+    uint8_t tail[28];
+    FILE *tfp = fopen(path, "rb");
+    if (NULL == tfp) return NULL;
+    bool has_eof = st.st_size >= 28 && 0 == fseek(tfp, -28, SEEK_END) && 1 == fread(tail, 28, 1, tfp) &&
+                   0 == memcmp(tail, BGZF_EOF_BLOCK, 28);
+    fclose(tfp);
+    if (has_eof && 0 != truncate(path, st.st_size - 28)) return NULL;
+
+    char amode[4];
+    strcpy(amode, mode);
+    amode[0] = 'a';
+    return bgzf_open(path, amode);
+}
+
+static void seg_unlink(shard_t *shard, label2seg *seg) {
+    if (NULL != seg->prev) seg->prev->next = seg->next; else shard->mru = seg->next;
+    if (NULL != seg->next) seg->next->prev = seg->prev; else shard->lru = seg->prev;
+    seg->prev = seg->next = NULL;
+}
+
+static void seg_push(shard_t *shard, label2seg *seg) {
+    // Make a segment the most recently used
+    seg->prev = NULL;
+    seg->next = shard->mru;
+    if (NULL != shard->mru) shard->mru->prev = seg;
+    shard->mru = seg;
+    if (NULL == shard->lru) shard->lru = seg;
+}
+
+static int8_t seg_close(shard_t *shard, label2seg *seg) {
+    seg_unlink(shard, seg);
+    shard->n_open--;
+    int close_stat = bgzf_close(seg->bgzf);
+    seg->bgzf = NULL;
+    if (close_stat < 0) {
+        log_msg("Fail to close temporary segment (%s)", ERROR, seg->path);
+        return 1;
+    }
+    return 0;
+}
+
+static BGZF *get_segment(shard_t *shard, char *tmpdir, uint32_t lid) {
+    label2seg *seg = shard->segs[lid];
+    if (NULL != seg && NULL != seg->bgzf) {
+        if (shard->mru != seg) {
+            seg_unlink(shard, seg);
+            seg_push(shard, seg);
+        }
+        return seg->bgzf;
+    }
+
+    // The least recently used segment makes room (it is reopened when its label comes back)
+    if (shard->n_open >= shard->max_open && 0 != seg_close(shard, shard->lru)) return NULL;
+
+    if (NULL != seg) {
+        seg->bgzf = bgzf_reopen(seg->path, OUT_MODE);
+        if (NULL == seg->bgzf) {
+            log_msg("Fail to reopen temporary segment (%s)", ERROR, seg->path);
+            return NULL;
+        }
+    } else {
+        // Segments are named by shard and order of appearance to stay away from odd characters in labels
+        seg = calloc(1, sizeof(label2seg));
+        if (NULL == seg) return NULL;
+        seg->lid = lid;
+        seg->path = calloc(strlen(tmpdir) + 24, sizeof(char));
+        sprintf(seg->path, "%ss%05u_%05u.bgzf", tmpdir, shard->sid, shard->n_segs);
+        // Segments end up in the outputs as they are, so they take the level of the outputs
+        seg->bgzf = bgzf_open(seg->path, OUT_MODE);
+        if (NULL == seg->bgzf) {
+            log_msg("Fail to create temporary segment (%s)", ERROR, seg->path);
+            free(seg->path);
+            free(seg);
+            return NULL;
+        }
+        shard->n_segs++;
+        shard->segs[lid] = seg;
+    }
+    shard->n_open++;
+    seg_push(shard, seg);
+    return seg->bgzf;
+}
+
+static int8_t shard_dump(shard_t *shard, shard_arg_t *args, bam1_t *read, raw_read_t *raw, cb_run_t *run) {
+    // Same filtering as the single-stream split in main()
+    tag_view_t cb_view;
+    int64_t val = label_of_read(read, args->bct, args->cb_meta, args->ub_meta, args->qthres, &cb_view, run);
+    if (val < 0) return 0;
+
+    uint32_t lval = (uint32_t) val;
+    const uint32_t *lids;
+    uint32_t n_lids = label_ids(args->labels, &lval, &lids);
+    for (uint32_t i = 0; i < n_lids; i++) {
+        BGZF *seg_fp = get_segment(shard, args->tmpdir, lids[i]);
+        if (NULL == seg_fp || (NULL != raw ? raw_write1(seg_fp, raw) : bam_write1(seg_fp, read)) < 0) {
+            log_msg("Fail to write reads of shard #%u (%s)", ERROR, shard->sid, args->labels->by_id[lids[i]]->label);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void split_shard(void *args_void) {
+    shard_arg_t *args = (shard_arg_t *) args_void;
+    shard_t *shard = args->shard;
+    shard->status = 1;
+
+    // Segments are indexed by label ID (n_labels stays 0 without them, for destroy_shards())
+    shard->segs = calloc(args->labels->n > 0 ? args->labels->n : 1, sizeof(label2seg *));
+    if (NULL == shard->segs) {
+        log_msg("Fail to allocate memory for shard #%u", ERROR, shard->sid);
+        return;
+    }
+    shard->n_labels = args->labels->n;
+
+    // Every worker needs its own handle to move around the file
+    samFile *fp = sam_open(args->bampath, "r");
+    if (NULL == fp) {
+        log_msg("Fail to open %s for shard #%u", ERROR, args->bampath, shard->sid);
+        return;
+    }
+    sam_hdr_t *header = sam_hdr_read(fp);
+    bam1_t *read = bam_init1();
+    int32_t read_stat = -1;
+
+    raw_read_t *raw = NULL;
+    cb_run_t run;
+    cb_run_init(&run, args->bct, false);
+    shard_reader_t sr;
+    shard_reader_init(&sr, fp, args->idx, shard, 1);
+    if (shard->by_offset && raw_supported(fp)) {
+        // Byte ranges are read sequentially, so records can be passed through as raw bytes
+        raw = raw_read_init();
+        BGZF *bfp = fp->fp.bgzf;
+        if (bgzf_seek(bfp, shard->voff_beg, SEEK_SET) < 0) {
+            log_msg("Fail to seek to shard #%u", ERROR, shard->sid);
+            goto free_and_exit;
+        }
+        while (shard->voff_end < 0 || bgzf_tell(bfp) < shard->voff_end) {
+            if (0 > (read_stat = raw_read1(bfp, raw))) break;
+            if (0 != shard_dump(shard, args, &raw->view, raw, &run)) goto free_and_exit;
+        }
+    } else {
+        while (0 <= (read_stat = shard_read1(&sr, read))) {
+            if (0 != shard_dump(shard, args, read, NULL, &run)) goto free_and_exit;
+        }
+    }
+    if (read_stat < -1) {
+        log_msg("Fail to read shard #%u (truncated or corrupted input?)", ERROR, shard->sid);
+        goto free_and_exit;
+    }
+    shard->status = 0;
+
+    free_and_exit:
+    while (NULL != shard->mru) {
+        if (0 != seg_close(shard, shard->mru)) shard->status = 1;
+    }
+    shard_reader_destroy(&sr);
+    raw_read_destroy(raw);
+    cb_run_destroy(&run);
+    bam_destroy1(read);
+    sam_hdr_destroy(header);
+    sam_close(fp);
+}
+
+int8_t append_bgzf_segment(BGZF *out, const char *path) {
+    /**
+     * @abstract Append the compressed blocks of a BGZF file to an open output without
+     * recompression, leaving out its EOF marker.
+     * @out An output BGZF handle whose pending data has been flushed
+     * @path Path to the segment to append
+     * @returns 0 on success; 1 on error
+     */
+    FILE *sfp = fopen(path, "rb");
+    if (NULL == sfp) {
+        log_msg("Fail to open temporary segment (%s)", ERROR, path);
+        return 1;
+    }
+
+    struct stat st = {0};
+    if (0 != fstat(fileno(sfp), &st)) {
+        fclose(sfp);
+        return 1;
+    }
+    int64_t to_copy = st.st_size;
+
+    // Drop the trailing EOF block so the output keeps a single one at the very end
+    uint8_t tail[28];
+    if (to_copy >= 28 && 0 == fseek(sfp, -28, SEEK_END) &&
+        1 == fread(tail, 28, 1, sfp) && 0 == memcmp(tail, BGZF_EOF_BLOCK, 28)) {
+        to_copy -= 28;
+    }
+    rewind(sfp);
+
+    int8_t return_val = 0;
+    size_t buf_size = 1 << 20;
+    uint8_t *buf = malloc(buf_size);
+    while (to_copy > 0) {
+        size_t want = to_copy < (int64_t) buf_size ? (size_t) to_copy : buf_size;
+        if (fread(buf, 1, want, sfp) != want || bgzf_raw_write(out, buf, want) < 0) {
+            log_msg("Fail to append temporary segment (%s)", ERROR, path);
+            return_val = 1;
+            break;
+        }
+        to_copy -= (int64_t) want;
+    }
+    free(buf);
+    fclose(sfp);
+    return return_val;
+}
+
+int8_t stitch_shards(shard_t *shards, int64_t n_shards, label_set_t *labels) {
+    /**
+     * @abstract Concatenate per-shard segments into the per-label outputs in shard order.
+     * @returns 0 on success; 1 on error
+     */
+    for (uint32_t lid = 0; lid < labels->n; lid++) {
+        // Waits for blocks still being compressed by the thread pool before raw blocks are appended
+        BGZF *out = label_output(labels, lid);
+        if (NULL == out) return 1;
+
+        for (int64_t i = 0; i < n_shards; i++) {
+            label2seg *seg = lid < shards[i].n_labels ? shards[i].segs[lid] : NULL;
+            if (NULL == seg) continue;
+            if (0 != append_bgzf_segment(out, seg->path)) return 1;
+            if (0 != unlink(seg->path)) {
+                log_msg("Fail to remove temporary segment (%s)", WARNING, seg->path);
+            }
+        }
+    }
+    return 0;
+}
+
+void destroy_shards(shard_t *shards, int64_t n_shards) {
+    for (int64_t i = 0; i < n_shards; i++) {
+        for (uint32_t lid = 0; lid < shards[i].n_labels; lid++) {
+            label2seg *seg = shards[i].segs[lid];
+            if (NULL == seg) continue;
+            if (NULL != seg->bgzf) bgzf_close(seg->bgzf);
+            free(seg->path);
+            free(seg);
+        }
+        free(shards[i].segs);
+    }
+    free(shards);
+}
+
+bool can_read_in_parallel(samFile *fp, const char *bampath) {
+    /**
+     * @abstract Check whether the input is a BGZF-compressed BAM file that several readers can
+     * revisit (not a stream), i.e., whether plan_shards() can cut it.
+     */
+    if (NULL == fp || fp->format.format != bam || fp->format.compression != bgzf) return false;
+    // Streams cannot be revisited by several readers
+    struct stat st = {0};
+    return 0 == stat(bampath, &st) && S_ISREG(st.st_mode);
+}
+
+shard_t *plan_shards(samFile *fp, char *bampath, sam_hdr_t *header, int64_t n_target,
+                     hts_idx_t **idx, int64_t *n_shards) {
+    /**
+     * @abstract Cut the input into shards: by genomic ranges if it is indexed, otherwise by byte ranges.
+     * @fp The input opened in main() with its header already read
+     * @idx Returns the loaded index (NULL if there is none); must be destroyed by the caller
+     * @returns An array of shards; NULL if the input cannot be sharded
+     */
+    *idx = NULL;
+    *n_shards = 0;
+    if (!can_read_in_parallel(fp, bampath)) return NULL;
+
+    shard_t *shards = NULL;
+    *idx = sam_index_load(fp, bampath);
+    if (NULL != *idx) {
+        shards = plan_region_shards(header, *idx, n_target, n_shards);
+        if (NULL == shards) {
+            log_msg("Fail to plan genomic ranges for parallel reading", WARNING);
+            hts_idx_destroy(*idx);
+            *idx = NULL;
+        }
+        return shards;
+    }
+
+    log_msg("No BAM index found; looking for record boundaries to cut the input by byte ranges", INFO);
+    shards = plan_block_shards(bampath, bgzf_tell(fp->fp.bgzf), header->n_targets, n_target, n_shards);
+    if (NULL == shards) {
+        log_msg("Fail to plan byte ranges for parallel reading", WARNING);
+    }
+    return shards;
+}
+
+uint32_t segment_budget(uint32_t max_open, uint32_t n_outputs) {
+    /**
+     * @abstract Segments each of the MAX_THREADS shards running at once can keep open, besides its
+     * own input, when n_outputs outputs are open too.
+     * @max_open Files that can be open at once (see open_file_budget())
+     */
+    if (max_open <= n_outputs) return 0;
+    uint32_t per_thread = (max_open - n_outputs) / (MAX_THREADS > 0 ? MAX_THREADS : 1);
+    return per_thread > 1 ? per_thread - 1 : 0;
+}
+
+static int8_t run_shards(shard_t *shards, int64_t n_shards, char *bampath, hts_idx_t *idx, char *tmpdir,
+                         bctable_t *bct, label_set_t *labels, int64_t qthres, tag_meta_t *cb_meta,
+                         tag_meta_t *ub_meta, uint32_t max_segs) {
+    // Each shard is split into per-label segments by a thread of its own
+    tpool_t *shard_tp = tpool_create(MAX_THREADS, MAX_THREADS);
+    for (int64_t i = 0; i < n_shards; i++) {
+        shards[i].max_open = max_segs > 0 ? max_segs : 1;
+        shard_arg_t args = {
+                .shard = &shards[i],
+                .bampath = bampath,
+                .idx = idx,
+                .tmpdir = tmpdir,
+                .bct = bct,
+                .labels = labels,
+                .qthres = qthres,
+                .cb_meta = cb_meta,
+                .ub_meta = ub_meta,
+        };
+        tpool_add_work(shard_tp, split_shard, &args, sizeof(shard_arg_t));
+    }
+    tpool_wait(shard_tp);
+    tpool_destroy(shard_tp);
+
+    for (int64_t i = 0; i < n_shards; i++) {
+        if (0 != shards[i].status) return 1;
+    }
+    return 0;
+}
+
+int8_t parallel_split(samFile *fp, char *bampath, sam_hdr_t *header, bctable_t *bct, label_set_t *labels,
+                      char *oprefix, int64_t qthres, tag_meta_t *cb_meta, tag_meta_t *ub_meta, uint32_t max_open) {
+    /**
+     * @abstract Split a BAM file without deduplication by letting each thread read its own part of
+     * the file, then concatenate the per-part results for every label. Indexed files are cut by
+     * genomic ranges; other BAM files are cut by byte ranges aligned to record boundaries.
+     * @fp The input opened in main() with its header already read
+     * @max_open Files that can be open at once, shared by the outputs and the segments of all threads
+     * @returns 0 on success; 1 on error; -1 if the input cannot be read in parallel
+     */
+    if (MAX_THREADS < 2) return -1;
+
+    // Segments get what the outputs leave: with spill files, only the spill files are open until
+    // the segments are stitched
+    uint32_t n_outputs = NULL != labels->spill ? labels->spill->n_buckets : labels->n;
+    uint32_t max_segs = segment_budget(max_open, n_outputs);
+    if (max_segs < SHARD_MIN_SEGMENTS) {
+        log_msg("Too few files can be open besides the outputs to read the input in parallel", INFO);
+        return -1;
+    }
+
+    int64_t n_shards = 0;
+    hts_idx_t *idx = NULL;
+    shard_t *shards = plan_shards(fp, bampath, header, MAX_THREADS * 4, &idx, &n_shards);
+    if (NULL == shards) return -1;
+    log_msg("Reading %" PRId64 " parts of the input with %" PRId64 " threads", INFO, n_shards, MAX_THREADS);
+
+    char *tmpdir = create_tempdir(oprefix);
+    int8_t return_val = run_shards(shards, n_shards, bampath, idx, tmpdir, bct, labels, qthres, cb_meta, ub_meta,
+                                   max_segs);
+    if (NULL != idx) hts_idx_destroy(idx);
+
+    if (0 == return_val) {
+        log_msg("Concatenating results of all parts of the input", INFO);
+        return_val = stitch_shards(shards, n_shards, labels);
+    }
+
+    destroy_shards(shards, n_shards);
+    if (0 == return_val && 0 != rmdir(tmpdir)) {
+        log_msg("Fail to remove temporary directory (%s)", WARNING, tmpdir);
+    }
+    free(tmpdir);
+    return return_val;
+}
+
+char *shard_dir(char *oprefix) {
+    // Partial results of array tasks are kept in [output]/shards/
+    char *sdir = calloc(strlen(oprefix) + 8, sizeof(char));
+    strcpy(sdir, oprefix);
+    strcat(sdir, "shards/");
+    return sdir;
+}
+
+static char *manifest_path(char *sdir, int64_t task) {
+    char *mpath = calloc(strlen(sdir) + 32, sizeof(char));
+    sprintf(mpath, "%stask%05" PRId64 ".manifest", sdir, task);
+    return mpath;
+}
+
+int8_t shard_task(samFile *fp, char *bampath, sam_hdr_t *header, bctable_t *bct, label_set_t *labels, char *oprefix,
+                  int64_t task, int64_t n_tasks, bool dedup, int64_t chunk_size, int64_t qthres,
+                  tag_meta_t *cb_meta, tag_meta_t *ub_meta, uint32_t max_open) {
+    /**
+     * @abstract Process one slice (task out of n_tasks) of the input for a cluster array job.
+     * The plan is computed the same way in every task, so slices never overlap.
+     * Partial results and a manifest listing them are left in [output]/shards/ for
+     * "scbamsplit finalize".
+     * @task The 1-based number of this task
+     * @max_open Files that can be open at once (outputs are only created by finalize)
+     * @returns 0 on success; 1 on error
+     */
+    int64_t n_shards = 0;
+    hts_idx_t *idx = NULL;
+    shard_t *plan = plan_shards(fp, bampath, header, n_tasks * 4, &idx, &n_shards);
+    if (NULL == plan) {
+        log_msg("The input cannot be cut into shards (only BGZF-compressed BAM files on disk can)", ERROR);
+        return 1;
+    }
+
+    // Shards are dealt out round-robin; finalize puts them back in plan order
+    shard_t *mine = calloc(n_shards, sizeof(shard_t));
+    int64_t n_mine = 0;
+    for (int64_t i = 0; i < n_shards; i++) {
+        if (i % n_tasks == task - 1) mine[n_mine++] = plan[i];
+    }
+    free(plan);
+    log_msg("Shard %" PRId64 "/%" PRId64 ": processing %" PRId64 " of %" PRId64 " parts of the input", INFO,
+            task, n_tasks, n_mine, n_shards);
+
+    char *sdir = shard_dir(oprefix);
+    struct stat st = {0};
+    if (0 != stat(sdir, &st) && 0 != mkdir(sdir, 0700) && EEXIST != errno) {
+        log_msg("Fail to create directory (%s)", ERROR, sdir);
+        free(sdir);
+        free(mine);
+        if (NULL != idx) hts_idx_destroy(idx);
+        return 1;
+    }
+
+    int8_t return_val = 0;
+    char *tmpdir = NULL;
+    if (!dedup) {
+        return_val = run_shards(mine, n_mine, bampath, idx, sdir, bct, labels, qthres, cb_meta, ub_meta,
+                                segment_budget(max_open, 0));
+    } else {
+        // Sorted chunks of this task go to [output]/shards/taskNNNNN/tmp/
+        char *task_prefix = calloc(strlen(sdir) + 32, sizeof(char));
+        if (NULL != task_prefix) sprintf(task_prefix, "%stask%05" PRId64 "/", sdir, task);
+        if (NULL == task_prefix || (0 != mkdir(task_prefix, 0700) && EEXIST != errno)) {
+            log_msg("Fail to create the directory of shard %" PRId64 " in %s (Error: %s)", ERROR, task, sdir,
+                    strerror(errno));
+            return_val = 1;
+        } else {
+            shard_reader_t sr;
+            shard_reader_init(&sr, fp, idx, mine, n_mine);
+            tmpdir = process_bam(fp, &sr, header, chunk_size, task_prefix, qthres, cb_meta, ub_meta);
+            shard_reader_destroy(&sr);
+            if (strcmp(tmpdir, "1") == 0) {
+                tmpdir = NULL;
+                return_val = 1;
+            }
+        }
+        free(task_prefix);
+    }
+    if (NULL != idx) hts_idx_destroy(idx);
+
+    // The manifest is written last and renamed into place, so its presence means the task is complete
+    if (0 == return_val) {
+        char *mpath = manifest_path(sdir, task);
+        char *mtmp = calloc(strlen(mpath) + 5, sizeof(char));
+        strcpy(mtmp, mpath);
+        strcat(mtmp, ".tmp");
+        FILE *mfp = fopen(mtmp, "w");
+        if (NULL == mfp) {
+            log_msg("Fail to write the manifest (%s)", ERROR, mtmp);
+            return_val = 1;
+        } else {
+            fprintf(mfp, "input\t%s\n", bampath);
+            fprintf(mfp, "shard\t%" PRId64 "\t%" PRId64 "\n", task, n_tasks);
+            fprintf(mfp, "mode\t%s\n", dedup ? "dedup" : "split");
+            if (!dedup) {
+                for (int64_t i = 0; i < n_mine; i++) {
+                    for (uint32_t lid = 0; lid < mine[i].n_labels; lid++) {
+                        label2seg *seg = mine[i].segs[lid];
+                        if (NULL == seg) continue;
+                        fprintf(mfp, "segment\t%u\t%s\t%u\t%s\n", mine[i].sid, seg->path + strlen(sdir),
+                                lid, labels->by_id[lid]->label);
+                    }
+                }
+            } else {
+                str_vec_t *chunks = get_bams(tmpdir);
+                for (int64_t i = 0; NULL != chunks && i < chunks->length; i++) {
+                    fprintf(mfp, "chunk\t%s%s\n", tmpdir + strlen(sdir), chunks->str_arr[i]);
+                }
+                if (NULL != chunks) str_vec_destroy(chunks);
+            }
+            if (0 != fclose(mfp) || 0 != rename(mtmp, mpath)) {
+                log_msg("Fail to write the manifest (%s)", ERROR, mpath);
+                return_val = 1;
+            }
+        }
+        free(mtmp);
+        free(mpath);
+    }
+
+    if (NULL != tmpdir) free(tmpdir);
+    destroy_shards(mine, n_mine);
+    free(sdir);
+    return return_val;
+}
+
+typedef struct {
+    uint32_t sid;
+    uint32_t lid;
+    char *path;
+    char *label;
+} seg_entry_t;
+
+static int seg_entry_cmp(const void *a, const void *b) {
+    const seg_entry_t *sa = (const seg_entry_t *) a;
+    const seg_entry_t *sb = (const seg_entry_t *) b;
+    return (sa->sid > sb->sid) - (sa->sid < sb->sid);
+}
+
+char *finalize_shards(char *oprefix, bool dedup, label_set_t *labels) {
+    /**
+     * @abstract Combine the partial results of all array tasks. Without deduplication, segments are
+     * concatenated into the per-label outputs in labels. With deduplication, the sorted chunks of
+     * all tasks are moved into [output]/tmp/ to be merged and split by the caller.
+     * @returns "0" when done without deduplication; the temporary directory with all chunks
+     * (to be freed) with deduplication; NULL on error
+     */
+    char *sdir = shard_dir(oprefix);
+    char *result = NULL;
+    seg_entry_t *entries = NULL;
+    int64_t n_entries = 0, m_entries = 0;
+    char *tmpdir = dedup ? create_tempdir(oprefix) : NULL;
+    int64_t n_tasks = -1;
+    int64_t n_chunks = 0;
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    for (int64_t task = 1; -1 == n_tasks || task <= n_tasks; task++) {
+        char *mpath = manifest_path(sdir, task);
+        FILE *mfp = fopen(mpath, "r");
+        if (NULL == mfp) {
+            log_msg("Missing manifest (%s): has shard %" PRId64 " finished?", ERROR, mpath, task);
+            free(mpath);
+            goto free_and_exit;
+        }
+        free(mpath);
+
+        ssize_t line_len;
+        bool malformed = false;
+        while (!malformed && (line_len = getline(&line, &line_cap, mfp)) > 0) {
+            line[strcspn(line, "\n")] = 0;
+            char *field = strtok(line, "\t");
+            if (NULL == field) continue;
+            if (0 == strcmp(field, "shard")) {
+                char *total_str = NULL == strtok(NULL, "\t") ? NULL : strtok(NULL, "\t");
+                int64_t total = NULL == total_str ? 0 : strtol(total_str, NULL, 10);
+                if (total < 1) {
+                    malformed = true;
+                } else if (-1 != n_tasks && total != n_tasks) {
+                    log_msg("Shards were run with different totals (%" PRId64 " and %" PRId64 ")", ERROR,
+                            n_tasks, total);
+                    fclose(mfp);
+                    goto free_and_exit;
+                }
+                n_tasks = total;
+            } else if (0 == strcmp(field, "mode")) {
+                char *mode = strtok(NULL, "\t");
+                if (NULL == mode) {
+                    malformed = true;
+                } else if ((0 == strcmp(mode, "dedup")) != dedup) {
+                    log_msg("Shards must be finalized with the same -d/--dedup setting they were run with", ERROR);
+                    fclose(mfp);
+                    goto free_and_exit;
+                }
+            } else if (0 == strcmp(field, "segment")) {
+                char *sid = strtok(NULL, "\t");
+                char *file = strtok(NULL, "\t");
+                char *lid = strtok(NULL, "\t");
+                // The label is the rest of the line, tabs included
+                char *label = strtok(NULL, "");
+                if (NULL == sid || NULL == file || NULL == lid || NULL == label) {
+                    malformed = true;
+                    continue;
+                }
+                if (n_entries == m_entries) {
+                    int64_t new_m = m_entries ? m_entries * 2 : 1024;
+                    seg_entry_t *new_entries = realloc(entries, new_m * sizeof(seg_entry_t));
+                    if (NULL == new_entries) {
+                        log_msg("Fail to allocate memory for the segments of shards", ERROR);
+                        fclose(mfp);
+                        goto free_and_exit;
+                    }
+                    entries = new_entries;
+                    m_entries = new_m;
+                }
+                entries[n_entries].sid = strtoul(sid, NULL, 10);
+                entries[n_entries].lid = strtoul(lid, NULL, 10);
+                entries[n_entries].path = calloc(strlen(sdir) + strlen(file) + 1, sizeof(char));
+                strcpy(entries[n_entries].path, sdir);
+                strcat(entries[n_entries].path, file);
+                entries[n_entries].label = strdup(label);
+                n_entries++;
+            } else if (0 == strcmp(field, "chunk")) {
+                // Give every chunk a new name that is unique across tasks
+                char *file = strtok(NULL, "\t");
+                if (NULL == file) {
+                    malformed = true;
+                    continue;
+                }
+                char *from = calloc(strlen(sdir) + strlen(file) + 1, sizeof(char));
+                strcpy(from, sdir);
+                strcat(from, file);
+                n_chunks++;
+                char *to = tname_init(tmpdir, "chunk", 8, n_chunks);
+                if (0 != rename(from, to)) {
+                    log_msg("Fail to move %s to %s", ERROR, from, to);
+                    free(from);
+                    free(to);
+                    fclose(mfp);
+                    goto free_and_exit;
+                }
+                free(from);
+                free(to);
+            }
+        }
+        fclose(mfp);
+        if (malformed || -1 == n_tasks) {
+            log_msg("Malformed manifest for shard %" PRId64, ERROR, task);
+            goto free_and_exit;
+        }
+    }
+    log_msg("All %" PRId64 " shards have finished", INFO, n_tasks);
+
+    if (dedup) {
+        result = tmpdir;
+        tmpdir = NULL;
+        goto remove_shard_dir;
+    }
+
+    // Headers are flushed (waiting for the thread pool) before raw blocks are appended
+    label2fp *fout;
+    BGZF *out;
+    qsort(entries, n_entries, sizeof(seg_entry_t), seg_entry_cmp);
+    for (int64_t i = 0; i < n_entries; i++) {
+        // Labels are matched by ID, as the same name can be in several metadata tables
+        fout = entries[i].lid < labels->n ? labels->by_id[entries[i].lid] : NULL;
+        if (NULL == fout || 0 != strcmp(fout->label, entries[i].label)) {
+            log_msg("Label %s of the shards is not in the metadata", ERROR, entries[i].label);
+            goto free_and_exit;
+        }
+        if (NULL == (out = label_output(labels, entries[i].lid)) || 0 != append_bgzf_segment(out, entries[i].path)) {
+            goto free_and_exit;
+        }
+        if (0 != unlink(entries[i].path)) {
+            log_msg("Fail to remove temporary segment (%s)", WARNING, entries[i].path);
+        }
+    }
+    result = "0";
+
+    remove_shard_dir:
+    for (int64_t task = 1; task <= n_tasks; task++) {
+        char *mpath = manifest_path(sdir, task);
+        unlink(mpath);
+        free(mpath);
+        if (dedup) {
+            // Emptied [output]/shards/taskNNNNN/tmp/
+            char *task_dir = calloc(strlen(sdir) + 20, sizeof(char));
+            sprintf(task_dir, "%stask%05" PRId64 "/tmp/", sdir, task);
+            rmdir(task_dir);
+            task_dir[strlen(task_dir) - 4] = 0;
+            rmdir(task_dir);
+            free(task_dir);
+        }
+    }
+    if (0 != rmdir(sdir)) {
+        log_msg("Fail to remove the directory of partial results (%s)", WARNING, sdir);
+    }
+
+    free_and_exit:
+    for (int64_t i = 0; i < n_entries; i++) {
+        free(entries[i].path);
+        free(entries[i].label);
+    }
+    free(entries);
+    free(line);
+    if (NULL != tmpdir) free(tmpdir);
+    free(sdir);
+    return result;
+}
@@ -0,0 +1,95 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+
+#ifndef SCBAMSPLIT_SHARD_H
+#define SCBAMSPLIT_SHARD_H
+#include <stdbool.h>
+#include "htslib/sam.h"
+#include "uthash.h"
+#include "hash.h"
+#include "utils.h"
+
+// Segments each running shard keeps open at least (see segment_budget())
+#define SHARD_MIN_SEGMENTS 16
+
+// A per-shard, per-label BGZF segment (records only, no header)
+typedef struct label2seg {
+    uint32_t lid;
+    char *path;
+    BGZF *bgzf;                /* NULL while closed to stay within the open file limit */
+    struct label2seg *prev;    /* more recently used open segment */
+    struct label2seg *next;
+} label2seg;
+
+typedef struct {
+    // Genomic range [(tid_beg, pos_beg), (tid_end, pos_end)) in index order;
+    // tid_beg == HTS_IDX_NOCOORD marks the shard of unplaced reads
+    int32_t tid_beg;
+    hts_pos_t pos_beg;
+    int32_t tid_end;
+    hts_pos_t pos_end;
+    // Or byte range [voff_beg, voff_end) in virtual offsets (voff_end == -1 reads to EOF)
+    bool by_offset;
+    int64_t voff_beg;
+    int64_t voff_end;
+    uint32_t sid;
+    label2seg **segs;          /* indexed by label ID; NULL for labels without reads */
+    uint32_t n_labels;
+    uint32_t n_segs;
+    uint32_t max_open;         /* segments kept open at once; the least recently used is closed first */
+    uint32_t n_open;
+    label2seg *mru;
+    label2seg *lru;
+    int8_t status;
+} shard_t;
+
+// Reads the records of a list of shards in order through one file handle
+typedef struct shard_reader {
+    samFile *fp;
+    sam_hdr_t *header;
+    hts_idx_t *idx;
+    shard_t *shards;
+    int64_t n_shards;
+    int64_t cur;
+    bool started;
+    int32_t tid;
+    hts_pos_t beg;
+    hts_itr_t *itr;
+} shard_reader_t;
+
+typedef struct {
+    shard_t *shard;
+    char *bampath;
+    hts_idx_t *idx;
+    char *tmpdir;
+    bctable_t *bct;
+    label_set_t *labels;
+    int64_t qthres;
+    tag_meta_t *cb_meta;
+    tag_meta_t *ub_meta;
+} shard_arg_t;
+
+shard_t *plan_region_shards(sam_hdr_t *header, hts_idx_t *idx, int64_t n_target, int64_t *n_shards);
+shard_t *plan_block_shards(const char *bampath, int64_t first_voff, int32_t n_ref, int64_t n_target,
+                           int64_t *n_shards);
+bool can_read_in_parallel(samFile *fp, const char *bampath);
+shard_t *plan_shards(samFile *fp, char *bampath, sam_hdr_t *header, int64_t n_target,
+                     hts_idx_t **idx, int64_t *n_shards);
+int8_t shard_reader_init(shard_reader_t *sr, samFile *fp, hts_idx_t *idx, shard_t *shards, int64_t n_shards);
+int shard_read1(shard_reader_t *sr, bam1_t *read);
+void shard_reader_destroy(shard_reader_t *sr);
+BGZF *bgzf_reopen(const char *path, const char *mode);
+int8_t append_bgzf_segment(BGZF *out, const char *path);
+uint32_t segment_budget(uint32_t max_open, uint32_t n_outputs);
+int8_t stitch_shards(shard_t *shards, int64_t n_shards, label_set_t *labels);
+void destroy_shards(shard_t *shards, int64_t n_shards);
+int8_t parallel_split(samFile *fp, char *bampath, sam_hdr_t *header, bctable_t *bct, label_set_t *labels,
+                      char *oprefix, int64_t qthres, tag_meta_t *cb_meta, tag_meta_t *ub_meta, uint32_t max_open);
+char *shard_dir(char *oprefix);
+int8_t shard_task(samFile *fp, char *bampath, sam_hdr_t *header, bctable_t *bct, label_set_t *labels, char *oprefix,
+                  int64_t task, int64_t n_tasks, bool dedup, int64_t chunk_size, int64_t qthres,
+                  tag_meta_t *cb_meta, tag_meta_t *ub_meta, uint32_t max_open);
+char *finalize_shards(char *oprefix, bool dedup, label_set_t *labels);
+
+#endif //SCBAMSPLIT_SHARD_H
@@ -8,90 +8,334 @@
 #include "sort.h"
 #include "utils.h"
 #include "thread_pool.h"
-
-int8_t fetch_tag(bam1_t *read, char *tag, char* tag_ptr) {
-    // bam_aux_get_str() exists, but to return a kstring,
-    // it involves realloc() and is rather slow.
-    // We ask users to specify UB and CB size here, so we
-    // should take advantage of this information to gain
-    // some efficiency.
-    char* tag_content = (char *) bam_aux_get(read, tag);
-    if (NULL == tag_content) {
-        // Tag not found
-        return -1;
-    }
-    strcpy(tag_ptr, tag_content + 1);
-    return 0;
-}
-int8_t fetch_tag2(bam1_t *read, char* tag_ptr, tag_meta_t *info) {
-    // bam_aux_get_str() exists, but to return a kstring,
-    // it involves realloc() and is rather slow.
-    // We ask users to specify UB and CB size here, so we
-    // should take advantage of this information to gain
-    // some efficiency.
-    char* tag_content = (char *) bam_aux_get(read, info->tag_name);
-    if (NULL == tag_content) {
-        // Tag not found
-        return -1;
-    }
-    strncpy(tag_ptr, tag_content + 1, info->length - 1);
-    return 0;
+#include "shard.h"
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+static inline int64_t aux_value_size(const uint8_t *type, const uint8_t *end) {
+    // Size of an aux value (after the type character); -1 if it runs past the end of the record
+    const uint8_t *val = type + 1;
+    switch (*type) {
+        case 'A': case 'c': case 'C':
+            return 1;
+        case 's': case 'S':
+            return 2;
+        case 'i': case 'I': case 'f':
+            return 4;
+        case 'd':
+            return 8;
+        case 'Z': case 'H': {
+            const uint8_t *nul = memchr(val, '\0', end - val);
+            return NULL == nul ? -1 : nul - val + 1;
+        }
+        case 'B': {
+            if (end - val < 5) return -1;
+            uint32_t count = (uint32_t) val[1] | (uint32_t) val[2] << 8 |
+                             (uint32_t) val[3] << 16 | (uint32_t) val[4] << 24;
+            int64_t width;
+            switch (val[0]) {
+                case 'c': case 'C': width = 1; break;
+                case 's': case 'S': width = 2; break;
+                case 'i': case 'I': case 'f': width = 4; break;
+                default: return -1;
+            }
+            return 5 + width * count;
+        }
+        default:
+            return -1;
+    }
 }
 
-int8_t fetch_name(bam1_t *read, char* tag_ptr, tag_meta_t *info) {
-    char* rn = bam_get_qname(read);
+static inline int32_t aux_walk(bam1_t *read, aux_field_t *fields, int32_t n_fields) {
+    // Body of aux_scan(), inlined where the tags are known at compile time (see barcode presets)
+    const uint8_t *p = bam_get_aux(read);
+    const uint8_t *end = read->data + read->l_data;
+    int32_t n_found = 0;
+    for (int32_t i = 0; i < n_fields; i++) fields[i].len = -1;
+
+    while (end - p >= 3 && n_found < n_fields) {
+        int64_t size = aux_value_size(p + 2, end);
+        if (size < 0 || end - (p + 3) < size) return -1;
+
+        for (int32_t i = 0; i < n_fields; i++) {
+            if (fields[i].len != -1 || fields[i].tag[0] != p[0] || fields[i].tag[1] != p[1]) continue;
+            fields[i].val = (const char *) p + 3;
+            // Strings are reported without their NUL terminator
+            fields[i].len = (p[2] == 'Z' || p[2] == 'H') ? (int32_t) size - 1 : (int32_t) size;
+            n_found++;
+        }
+        p += 3 + size;
+    }
+    return n_found;
+}
 
-    if (rn[0] == info->sep[0]) return -1;
+int32_t aux_scan(bam1_t *read, aux_field_t *fields, int32_t n_fields) {
+    /**
+     * @abstract Look for several tags in one walk over the aux data of a read, instead of
+     * walking it once per tag with bam_aux_get(). Values are not copied: bam_aux_get_str()
+     * returns a kstring, which involves realloc() and is rather slow.
+     * @read A pointer to bam1_t (HTSlib)
+     * @fields Tags to look for; val and len are filled in (len is -1 for absent tags)
+     * @n_fields Number of tags in fields
+     * @returns The number of tags found; -1 if the aux data is malformed
+     */
+    return aux_walk(read, fields, n_fields);
+}
 
-    // Need to copy -- strtok will modify the string
-    char *rncpy = calloc(strlen(rn) + 1, sizeof(char));
-    strcpy(rncpy, rn);
-    char *token;
+static inline int32_t next_sep(const char *s, int32_t pos, int32_t len, char sep) {
+    // Position of the next separator at or after pos; len if there is none
+#if defined(__AVX2__)
+    __m256i sep32 = _mm256_set1_epi8(sep);
+    for (; pos + 32 <= len; pos += 32) {
+        uint32_t hit = (uint32_t) _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (s + pos)), sep32));
+        if (hit) return pos + __builtin_ctz(hit);
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i sep16 = _mm_set1_epi8(sep);
+    for (; pos + 16 <= len; pos += 16) {
+        uint32_t hit = (uint32_t) _mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (s + pos)), sep16));
+        if (hit) return pos + __builtin_ctz(hit);
+    }
+#endif
+    for (; pos < len; pos++) {
+        if (s[pos] == sep) return pos;
+    }
+    return len;
+}
 
+static int32_t name_fields(bam1_t *read, char sep, const uint8_t *field_nums, tag_view_t **views, int32_t n) {
+    /**
+     * @abstract Find fields of the read name in one scan, without copying the name. Fields are
+     * split as strtok() does, i.e. consecutive separators count as one.
+     * @field_nums 1-based numbers of the fields to find
+     * @views Returns the fields as pointers into the read name
+     * @returns The number of fields found; -1 if the read name starts with the separator
+     */
+    const char *rn = bam_get_qname(read);
+    // The name is NUL-terminated and may be padded with extra NULs
+    int32_t len = read->core.l_qname - read->core.l_extranul - 1;
+    if (len > 0 && rn[0] == sep) return -1;
 
+    int32_t pos = 0;
+    int32_t n_found = 0;
     uint8_t field_num = 0;
-    int8_t return_val = 1;
-    token = strtok(rncpy, info->sep);
-    while (token != NULL) {
+    while (pos < len && n_found < n) {
+        while (pos < len && rn[pos] == sep) pos++;
+        if (pos == len) break;
+        int32_t end = next_sep(rn, pos, len, sep);
         field_num++;
-        if (field_num == info->field) {
-            strcpy(tag_ptr, token);
-            return_val = 0;
+        for (int32_t i = 0; i < n; i++) {
+            if (field_nums[i] != field_num) continue;
+            views[i]->s = rn + pos;
+            views[i]->len = end - pos;
+            n_found++;
         }
-        token = strtok(NULL, info->sep);
+        pos = end;
     }
-    free(rncpy);
-    return return_val;
+    return n_found;
 }
-int8_t get_CB (bam1_t *read, tag_meta_t* info, char* tag_ptr) {
-    int8_t exit_code = 0;
-    switch (info->location) {
-        case READ_TAG:
-            exit_code = fetch_tag2(read, tag_ptr, info);
-            break;
-        case READ_NAME:
-            exit_code = fetch_name(read, tag_ptr, info);
-            break;
-        default:
-            log_msg("Unknown location type to fetch cell barcode", ERROR);
-            exit_code = 1;
+
+int8_t get_barcodes(bam1_t *read, tag_meta_t *cb_meta, tag_meta_t *ub_meta, tag_view_t *cb, tag_view_t *ub) {
+    /**
+     * @abstract Get the cell barcode and UMI of a read as pointers into the read, without copying.
+     * Read tags are found in a single walk over the aux data and cut to the lengths in the tag
+     * metadata; read name fields are found in a single scan of the read name.
+     * @ub_meta May be NULL to only get the cell barcode (or only the UMI, given ub_meta as cb_meta)
+     * @cb, ub Returns the barcode and UMI
+     * @returns 0 on success; -1 if either is missing; 1 on error
+     */
+    aux_field_t fields[2];
+    int32_t n_fields = 0;
+    int8_t n_metas = NULL == ub_meta ? 1 : 2;
+    if (READ_TAG == cb_meta->location) {
+        memcpy(fields[n_fields].tag, cb_meta->tag_name, 2);
+        n_fields++;
+    }
+    if (2 == n_metas && READ_TAG == ub_meta->location) {
+        memcpy(fields[n_fields].tag, ub_meta->tag_name, 2);
+        n_fields++;
+    }
+    if (n_fields > 0 && aux_scan(read, fields, n_fields) < 0) {
+        log_msg("Malformed read tags in %s", ERROR, bam_get_qname(read));
+        return 1;
+    }
+
+    // Name fields sharing a separator are found in the same scan
+    if (2 == n_metas && READ_NAME == cb_meta->location && READ_NAME == ub_meta->location &&
+        cb_meta->sep[0] == ub_meta->sep[0]) {
+        uint8_t field_nums[2] = {cb_meta->field, ub_meta->field};
+        tag_view_t *views[2] = {cb, ub};
+        if (name_fields(read, cb_meta->sep[0], field_nums, views, 2) < 2) return -1;
+        return 0;
+    }
+
+    int32_t fid = 0;
+    tag_meta_t *metas[2] = {cb_meta, ub_meta};
+    tag_view_t *views[2] = {cb, ub};
+    for (int8_t i = 0; i < n_metas; i++) {
+        if (READ_TAG == metas[i]->location) {
+            if (-1 == fields[fid].len) return -1;
+            views[i]->s = fields[fid].val;
+            views[i]->len = fields[fid].len < metas[i]->length - 1 ? fields[fid].len : metas[i]->length - 1;
+            fid++;
+        } else if (name_fields(read, metas[i]->sep[0], &metas[i]->field, &views[i], 1) < 1) {
+            return -1;
+        }
     }
-    return exit_code;
+    return 0;
 }
-int8_t get_UB (bam1_t *read, tag_meta_t* info, char* tag_ptr) {
-    int8_t exit_code = 0;
-    switch (info->location) {
-        case READ_TAG:
-            exit_code = fetch_tag2(read, tag_ptr, info);
-            break;
-        case READ_NAME:
-            exit_code = fetch_name(read, tag_ptr, info);
+
+static inline int8_t tag_barcodes(bam1_t *read, const char *cb_tag, int32_t cb_max, const char *ub_tag,
+                                  int32_t ub_max, tag_view_t *cb, tag_view_t *ub) {
+    // get_barcodes() for barcodes in read tags, with tags and lengths fixed by the caller
+    int32_t n_fields = NULL == ub_tag ? 1 : 2;
+    aux_field_t fields[2] = {
+        {.tag = {cb_tag[0], cb_tag[1]}, .val = NULL, .len = -1},
+        {.tag = {0, 0}, .val = NULL, .len = -1}
+    };
+    if (2 == n_fields) memcpy(fields[1].tag, ub_tag, 2);
+    if (aux_walk(read, fields, n_fields) < 0) {
+        log_msg("Malformed read tags in %s", ERROR, bam_get_qname(read));
+        return 1;
+    }
+    if (-1 == fields[0].len || (2 == n_fields && -1 == fields[1].len)) return -1;
+    cb->s = fields[0].val;
+    cb->len = fields[0].len < cb_max ? fields[0].len : cb_max;
+    if (2 == n_fields) {
+        ub->s = fields[1].val;
+        ub->len = fields[1].len < ub_max ? fields[1].len : ub_max;
+    }
+    return 0;
+}
+
+// Specializations of get_barcodes() for the presets of set_CB() and set_UB(), where tags,
+// lengths and separators are constants. The tag_meta_t arguments are unused.
+#define TAG_BARCODES(cb_max, ub_max) \
+static int8_t tag_barcodes_##cb_max##_##ub_max(bam1_t *read, tag_meta_t *cb_meta, tag_meta_t *ub_meta, \
+                                               tag_view_t *cb, tag_view_t *ub) { \
+    (void) cb_meta; \
+    (void) ub_meta; \
+    return tag_barcodes(read, "CB", cb_max, "UB", ub_max, cb, ub); \
+}
+#define TAG_BARCODE(tag, max) \
+static int8_t tag_barcode_##tag##_##max(bam1_t *read, tag_meta_t *cb_meta, tag_meta_t *ub_meta, \
+                                        tag_view_t *cb, tag_view_t *ub) { \
+    (void) cb_meta; \
+    (void) ub_meta; \
+    (void) ub; \
+    return tag_barcodes(read, #tag, max, NULL, 0, cb, NULL); \
+}
+TAG_BARCODES(18, 12)
+TAG_BARCODES(18, 10)
+TAG_BARCODES(20, 20)
+TAG_BARCODE(CB, 18)
+TAG_BARCODE(CB, 20)
+TAG_BARCODE(UB, 12)
+TAG_BARCODE(UB, 10)
+TAG_BARCODE(UB, 20)
+
+static int8_t name_barcodes_1_2(bam1_t *read, tag_meta_t *cb_meta, tag_meta_t *ub_meta,
+                                tag_view_t *cb, tag_view_t *ub) {
+    (void) cb_meta;
+    (void) ub_meta;
+    static const uint8_t field_nums[2] = {1, 2};
+    tag_view_t *views[2] = {cb, ub};
+    return name_fields(read, ',', field_nums, views, 2) < 2 ? -1 : 0;
+}
+
+static int8_t name_barcode_1(bam1_t *read, tag_meta_t *cb_meta, tag_meta_t *ub_meta, tag_view_t *cb, tag_view_t *ub) {
+    (void) cb_meta;
+    (void) ub_meta;
+    (void) ub;
+    static const uint8_t field_num = 1;
+    return name_fields(read, ',', &field_num, &cb, 1) < 1 ? -1 : 0;
+}
+
+static int8_t name_barcode_2(bam1_t *read, tag_meta_t *cb_meta, tag_meta_t *ub_meta, tag_view_t *cb, tag_view_t *ub) {
+    (void) cb_meta;
+    (void) ub_meta;
+    (void) ub;
+    static const uint8_t field_num = 2;
+    return name_fields(read, ',', &field_num, &cb, 1) < 1 ? -1 : 0;
+}
+
+typedef struct {
+    enum location location;
+    char tag_name[3];          /* with READ_TAG */
+    char sep;                  /* with READ_NAME */
+    uint8_t field;             /* with READ_NAME */
+    uint8_t length;            /* with READ_TAG; as in tag_meta_t, one more than the number of bases */
+} barcode_preset_t;
+
+static const barcode_preset_t CB_18 = {READ_TAG, "CB", 0, 0, 18 + 1};
+static const barcode_preset_t CB_20 = {READ_TAG, "CB", 0, 0, 20 + 1};
+static const barcode_preset_t UB_12 = {READ_TAG, "UB", 0, 0, 12 + 1};
+static const barcode_preset_t UB_10 = {READ_TAG, "UB", 0, 0, 10 + 1};
+static const barcode_preset_t UB_20 = {READ_TAG, "UB", 0, 0, 20 + 1};
+static const barcode_preset_t NAME_1 = {READ_NAME, "", ',', 1, 0};
+static const barcode_preset_t NAME_2 = {READ_NAME, "", ',', 2, 0};
+
+static const struct {
+    const char *name;
+    const barcode_preset_t *cb;
+    const barcode_preset_t *ub;
+    barcode_fn fn;
+} BARCODE_PAIRS[] = {
+        {"10Xv3", &CB_18, &UB_12, tag_barcodes_18_12},
+        {"10Xv2", &CB_18, &UB_10, tag_barcodes_18_10},
+        {"CB/UB", &CB_20, &UB_20, tag_barcodes_20_20},
+        {"sciRNAseq3", &NAME_1, &NAME_2, name_barcodes_1_2},
+};
+
+static const struct {
+    const barcode_preset_t *meta;
+    barcode_fn fn;
+} BARCODE_SINGLES[] = {
+        {&CB_18, tag_barcode_CB_18},
+        {&CB_20, tag_barcode_CB_20},
+        {&UB_12, tag_barcode_UB_12},
+        {&UB_10, tag_barcode_UB_10},
+        {&UB_20, tag_barcode_UB_20},
+        {&NAME_1, name_barcode_1},
+        {&NAME_2, name_barcode_2},
+};
+
+static bool is_preset(const tag_meta_t *meta, const barcode_preset_t *preset) {
+    if (meta->location != preset->location) return false;
+    if (READ_TAG == meta->location) {
+        return 0 == strncmp(meta->tag_name, preset->tag_name, 2) && meta->length == preset->length;
+    }
+    // Read name fields are not cut to the length
+    return meta->sep[0] == preset->sep && meta->field == preset->field;
+}
+
+static barcode_fn single_reader(const tag_meta_t *meta) {
+    for (size_t i = 0; i < sizeof(BARCODE_SINGLES) / sizeof(BARCODE_SINGLES[0]); i++) {
+        if (is_preset(meta, BARCODE_SINGLES[i].meta)) return BARCODE_SINGLES[i].fn;
+    }
+    return get_barcodes;
+}
+
+void choose_barcode_reader(tag_meta_t *cb_meta, tag_meta_t *ub_meta) {
+    /**
+     * @abstract Pick the routines that get barcodes from reads (BARCODES) once, so reads are not
+     * checked against the tag metadata one by one: tag metadata matching a platform preset gets
+     * a specialized routine, and anything else (e.g., set with -b or -l) uses get_barcodes().
+     */
+    BARCODES.both = get_barcodes;
+    for (size_t i = 0; i < sizeof(BARCODE_PAIRS) / sizeof(BARCODE_PAIRS[0]); i++) {
+        if (is_preset(cb_meta, BARCODE_PAIRS[i].cb) && is_preset(ub_meta, BARCODE_PAIRS[i].ub)) {
+            BARCODES.both = BARCODE_PAIRS[i].fn;
+            log_msg("Getting barcodes with the %s preset", DEBUG, BARCODE_PAIRS[i].name);
             break;
-        default:
-            log_msg("Unknown location type to fetch cell barcode", ERROR);
-            exit_code = 1;
+        }
     }
-    return exit_code;
+    BARCODES.cb = single_reader(cb_meta);
+    BARCODES.ub = single_reader(ub_meta);
 }
 
 
@@ -188,13 +432,14 @@ void get_MAPQ(bam1_t *read, char* val_ptr) {
     sprintf(val_ptr, "%03d", mapq);
 }
 
-int64_t fill_chunk(samFile *fp, sam_hdr_t *header, ichunk_t *ic, int16_t qthres,
+int64_t fill_chunk(samFile *fp, shard_reader_t *sr, sam_hdr_t *header, ichunk_t *ic, int16_t qthres,
                    tag_meta_t *cb_meta, tag_meta_t *ub_meta) {
     /**
      * @abstract Fill read buffer to designated size and return the index of next read to read or -1
      * when fails.
      *
      * @fp A file descriptor for a SAM/BAM file
+     * @sr If not NULL, only reads of the shards given to this reader are used
      * @header A header pointer from sam_hdr_read()
      * @read A pointer to a sam_read_t array to be filled
      * @chunk_size An integer to indicate how large the cache chunk to be filled
@@ -209,20 +454,19 @@ int64_t fill_chunk(samFile *fp, sam_hdr_t *header, ichunk_t *ic, int16_t qthres,
     // Note that read_array must be allocated OUTSIDE!
     bam1_t *temp_read = bam_init1();
     int64_t read_kept = 0;
-    char *CB;
-    char *UB;
     char *MAPQ;
     char *PR;
     char *RN; // Declare empty string of sufficient size
-    CB = (char *) calloc(CB_LENGTH, sizeof(char));
-    UB = (char *) calloc(UB_LENGTH, sizeof(char));
     MAPQ = (char *) calloc(4, sizeof(char)); // Max value for MAPQ is 255 per SAM spec v1
     PR = (char *) calloc(2, sizeof(char)); // The value for primary read is either 0 or 1
     RN = (char *) calloc(RN_SIZE, sizeof(char));
+    tag_view_t cb_view;
+    tag_view_t ub_view;
 
     // Fill the chunk until specified size or running out of reads
     while (read_kept < chunk_size) {
-        if (sam_read1(fp, header, temp_read) < 0) {
+        int read_stat = NULL == sr ? sam_read1(fp, header, temp_read) : shard_read1(sr, temp_read);
+        if (read_stat < 0) {
             // sam_read1 returns -1 when encountering an error
             // or EOF
             if (read_kept > 0) {
@@ -232,18 +476,17 @@ int64_t fill_chunk(samFile *fp, sam_hdr_t *header, ichunk_t *ic, int16_t qthres,
             goto stop_fill_and_free;
         }
 
-        int8_t cb_stat = get_CB(temp_read, cb_meta, CB);
-        int8_t ub_stat = get_UB(temp_read, ub_meta, UB);
+        int8_t bc_stat = BARCODES.both(temp_read, cb_meta, ub_meta, &cb_view, &ub_view);
         int8_t prim_stat = is_primary(temp_read, PR);
         get_MAPQ(temp_read, MAPQ); // MAPQ seems to be guaranteed by SAM spec
         int16_t mapq_val = temp_read->core.qual;
 
         // Skip reads that miss CB, UB, bitwise flag, or MAPQ
-        if ((-1 == cb_stat) || (-1 == ub_stat) || (1 == prim_stat) || qthres > mapq_val) {
+        if ((-1 == bc_stat) || (1 == prim_stat) || qthres > mapq_val) {
             // If a read has no CBC or UMI, just let it go.
             continue;
-        } else if (1 == cb_stat || 1 == ub_stat) {
-            // Error message is produced in fetch_tag()
+        } else if (1 == bc_stat) {
+            // Error message is produced in get_barcodes()
             read_kept = -1;
             goto stop_fill_and_free;
         }
@@ -275,13 +518,13 @@ int64_t fill_chunk(samFile *fp, sam_hdr_t *header, ichunk_t *ic, int16_t qthres,
         }
         sprintf(RN, fmt, bam_get_qname(temp_read));
 
-        // Initialize the key string
-        strcpy(read_array[read_kept]->key, "");
-
         // Concatenate CBC, UMI, read name, primary or secondary, MAPQ
         // Lump reads that are supposed to be the same molecule
-        strcat(read_array[read_kept]->key, CB);
-        strcat(read_array[read_kept]->key, UB);
+        char *key_end = read_array[read_kept]->key;
+        memcpy(key_end, cb_view.s, cb_view.len);
+        key_end += cb_view.len;
+        memcpy(key_end, ub_view.s, ub_view.len);
+        key_end[ub_view.len] = '\0';
         // Show primary mapping first and sort by MAPQ
         // so later exporting mechanism can just export the
         // first and all secondary mappings (if exists) by
@@ -309,8 +552,6 @@ int64_t fill_chunk(samFile *fp, sam_hdr_t *header, ichunk_t *ic, int16_t qthres,
         bam_destroy1(temp_read);
         free(PR);
         free(MAPQ);
-        free(UB);
-        free(CB);
         free(RN);
     return read_kept;
 }
@@ -375,7 +616,8 @@ void sort_export_chunk(void *args_void) {
 
     char *tname = tname_init(args->tmpdir, "chunk", 5, args->tid);
 
-    htsFile* tfp = sam_open(tname, "wb");
+    htsFile* tfp = sam_open(tname, TMP_MODE);
+    attach_hts_pool(tfp);
 
     int write_status = sam_hdr_write(tfp, args->header);
     if (write_status != 0) {
@@ -404,12 +646,13 @@ void sort_export_chunk(void *args_void) {
     sam_close(tfp);
 }
 
-char *process_bam(samFile *fp, sam_hdr_t *header, int64_t chunk_size, char *oprefix, int64_t qthres,
-                  tag_meta_t *cb_meta, tag_meta_t *ub_meta) {
+char *process_bam(samFile *fp, shard_reader_t *sr, sam_hdr_t *header, int64_t chunk_size, char *oprefix,
+                  int64_t qthres, tag_meta_t *cb_meta, tag_meta_t *ub_meta) {
     /**
      * @abstract Process all reads in an opened SAM/BAM file in chunks and save sorted reads in a temporary
      * directory.
      * @fp A pointer to a samFile
+     * @sr A shard reader to only process part of the file (NULL for the whole file)
      * @header A pointer to a SAM file header
      * @chunk An array of sam_read_t's
      * @chunk_size The size of the array (a 64-bit integer)
@@ -459,7 +702,7 @@ char *process_bam(samFile *fp, sam_hdr_t *header, int64_t chunk_size, char *opre
         log_msg("Receiving a new chunk to fill", DEBUG);
 
         if (this_chunk->processed) {
-            size_retrieved = fill_chunk(fp, header, this_chunk, qthres, cb_meta, ub_meta);
+            size_retrieved = fill_chunk(fp, sr, header, this_chunk, qthres, cb_meta, ub_meta);
         }
 
         if (size_retrieved < -1) {
@@ -477,7 +720,8 @@ char *process_bam(samFile *fp, sam_hdr_t *header, int64_t chunk_size, char *opre
             sort_chunk(this_chunk);
 
             char *tname = tname_init(tmpdir, "chunk", 5, chunk_num);
-            htsFile* tfp = sam_open(tname, "wb");
+            htsFile* tfp = sam_open(tname, TMP_MODE);
+            attach_hts_pool(tfp);
             free(tname);
 
             int write_status = sam_hdr_write(tfp, header);
@@ -13,6 +13,8 @@ extern int64_t UB_LENGTH;
 #include "thread_pool.h"
 #include "utils.h"
 
+struct shard_reader;
+
 typedef struct {
     ichunk_t *ic;
     chunkq_t *give_q;
@@ -21,20 +23,39 @@ typedef struct {
     uint32_t tid;
 } chunk_arg_t;
 
-int8_t fetch_tag(bam1_t *read, char *tag, char *tag_ptr);
-int8_t get_CB (bam1_t *read, tag_meta_t* info, char* tag_ptr);
-int8_t get_UB (bam1_t *read, tag_meta_t* info, char* tag_ptr);
+// A tag to look for with aux_scan()
+typedef struct {
+    char tag[2];
+    const char *val; // Value in the read's aux data (the string itself for Z/H tags)
+    int32_t len;     // Length of a Z/H string or size of other values; -1 if the tag is absent
+} aux_field_t;
+
+// Signature of get_barcodes() and its specializations for platform presets
+typedef int8_t (*barcode_fn)(bam1_t *read, tag_meta_t *cb_meta, tag_meta_t *ub_meta, tag_view_t *cb, tag_view_t *ub);
+
+// Routines getting barcodes from reads, chosen once by choose_barcode_reader()
+typedef struct {
+    barcode_fn both;           /* cell barcode and UMI */
+    barcode_fn cb;             /* cell barcode only (given cb_meta) */
+    barcode_fn ub;             /* UMI only (given ub_meta as cb_meta) */
+} barcode_reader_t;
+
+extern barcode_reader_t BARCODES;
+
+int32_t aux_scan(bam1_t *read, aux_field_t *fields, int32_t n_fields);
+int8_t get_barcodes(bam1_t *read, tag_meta_t *cb_meta, tag_meta_t *ub_meta, tag_view_t *cb, tag_view_t *ub);
+void choose_barcode_reader(tag_meta_t *cb_meta, tag_meta_t *ub_meta);
 void set_CB(tag_meta_t *tag_meta, char *platform);
 void set_UB(tag_meta_t *tag_meta, char *platform);
 tag_meta_t *initialize_tag_meta();
 void print_tag_meta(tag_meta_t *tag_meta, const char *header);
 void destroy_tag_meta(tag_meta_t *tag_meta);
-int64_t fill_chunk(samFile *fp, sam_hdr_t *header, ichunk_t *ic, int16_t qthres,
+int64_t fill_chunk(samFile *fp, struct shard_reader *sr, sam_hdr_t *header, ichunk_t *ic, int16_t qthres,
            tag_meta_t *cb_meta, tag_meta_t *ub_meta);
 void sort_chunk(ichunk_t *ic);
 sam_read_t** chunk_init(uint32_t chunk_size);
 void chunk_destroy(sam_read_t **read_array, uint32_t chunk_size);
-char *process_bam(samFile *fp, sam_hdr_t *header, int64_t chunk_size, char *oprefix, int64_t qthres,
-                  tag_meta_t *cb_meta, tag_meta_t *ub_meta);
+char *process_bam(samFile *fp, struct shard_reader *sr, sam_hdr_t *header, int64_t chunk_size, char *oprefix,
+                  int64_t qthres, tag_meta_t *cb_meta, tag_meta_t *ub_meta);
 
 #endif //SCBAMSPLIT_SORT_H
@@ -0,0 +1,315 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "spill.h"
+#include "utils.h"
+#include "shard.h"
+
+uint64_t open_file_limit(void) {
+    // The soft limit of open files of the process (UINT64_MAX if unlimited)
+    struct rlimit rl;
+    if (0 != getrlimit(RLIMIT_NOFILE, &rl)) return 1024;
+    return RLIM_INFINITY == rl.rlim_cur ? UINT64_MAX : (uint64_t) rl.rlim_cur;
+}
+
+uint64_t raise_open_file_limit(void) {
+    /**
+     * @abstract Raise the soft limit of open files of the process to its hard limit, which needs
+     * no privilege.
+     * @returns The soft limit in effect afterwards
+     */
+    struct rlimit rl;
+    if (0 != getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur >= rl.rlim_max) return open_file_limit();
+    struct rlimit raised = {rl.rlim_max, rl.rlim_max};
+    if (0 != setrlimit(RLIMIT_NOFILE, &raised)) {
+        log_msg("Fail to raise the limit of open files (Error: %s)", WARNING, strerror(errno));
+    } else {
+        log_msg("Raised the limit of open files from %llu to %llu", INFO, (unsigned long long) rl.rlim_cur,
+                (unsigned long long) rl.rlim_max);
+    }
+    return open_file_limit();
+}
+
+uint32_t open_file_budget(uint64_t limit) {
+    /**
+     * @abstract Number of files that can be open at once for outputs (and their temporary files)
+     * under a limit of open files, less SPILL_FD_RESERVE and the thread pool.
+     * @limit The limit of open files (see open_file_limit())
+     */
+    uint64_t reserve = SPILL_FD_RESERVE + 2 * (MAX_THREADS > 0 ? MAX_THREADS : 1);
+    if (limit > UINT32_MAX) return UINT32_MAX;
+    return limit > reserve + 16 ? (uint32_t) (limit - reserve) : 16;
+}
+
+static char *bucket_path(spill_t *sp, uint32_t b) {
+    char *path = malloc(strlen(sp->dir) + 32);
+    if (NULL != path) sprintf(path, "%sbucket%05u.bgzf", sp->dir, b);
+    return path;
+}
+
+static void slot_unlink(spill_t *sp, int32_t s) {
+    spill_slot_t *slot = &sp->slots[s];
+    if (slot->prev >= 0) sp->slots[slot->prev].next = slot->next; else sp->mru = slot->next;
+    if (slot->next >= 0) sp->slots[slot->next].prev = slot->prev; else sp->lru = slot->prev;
+}
+
+static void slot_push(spill_t *sp, int32_t s) {
+    // Make a slot the most recently used
+    spill_slot_t *slot = &sp->slots[s];
+    slot->prev = -1;
+    slot->next = sp->mru;
+    if (sp->mru >= 0) sp->slots[sp->mru].prev = s;
+    sp->mru = s;
+    if (sp->lru < 0) sp->lru = s;
+}
+
+static int8_t slot_close(spill_t *sp, int32_t s) {
+    spill_slot_t *slot = &sp->slots[s];
+    slot_unlink(sp, s);
+    sp->slot_of[slot->lid] = -1;
+    sp->n_open--;
+    int close_stat = bgzf_close(slot->fp);
+    slot->fp = NULL;
+    if (0 != close_stat) {
+        log_msg("Fail to close output for %s", ERROR, sp->labels->by_id[slot->lid]->label);
+        return 1;
+    }
+    return 0;
+}
+
+static BGZF *spill_output(spill_t *sp, uint32_t lid) {
+    // The open output of a label: created with the header the first time, appended to afterwards
+    int32_t s = sp->slot_of[lid];
+    if (s >= 0) {
+        if (sp->mru != s) {
+            slot_unlink(sp, s);
+            slot_push(sp, s);
+        }
+        return sp->slots[s].fp;
+    }
+
+    if (sp->n_open == sp->n_slots) {
+        // Evict the least recently used output; its slot is reused
+        s = sp->lru;
+        if (0 != slot_close(sp, s)) return NULL;
+    } else {
+        s = (int32_t) sp->n_open;
+        while (NULL != sp->slots[s].fp) s = (s + 1) % (int32_t) sp->n_slots;
+    }
+
+    // Outputs are reopened without their EOF block, so none is left in the middle of the output
+    char *outpath = label_outpath(sp->labels, lid, sp->prefix);
+    BGZF *fp = NULL == outpath ? NULL : sp->created[lid] ? bgzf_reopen(outpath, OUT_MODE) : bgzf_open(outpath, OUT_MODE);
+    if (NULL == fp) {
+        log_msg("Fail to open output %s", ERROR, NULL == outpath ? sp->labels->by_id[lid]->label : outpath);
+        free(outpath);
+        return NULL;
+    }
+    free(outpath);
+    if (NULL != HTS_POOL.pool) bgzf_thread_pool(fp, HTS_POOL.pool, HTS_POOL.qsize);
+    if (!sp->created[lid]) {
+        if (0 != bam_hdr_write(fp, sp->header)) {
+            log_msg("Fail to prepare output for %s", ERROR, sp->labels->by_id[lid]->label);
+            bgzf_close(fp);
+            return NULL;
+        }
+        sp->created[lid] = true;
+    }
+
+    sp->slots[s].lid = lid;
+    sp->slots[s].fp = fp;
+    sp->slot_of[lid] = s;
+    sp->n_open++;
+    slot_push(sp, s);
+    return fp;
+}
+
+spill_t *spill_init(label_set_t *labels, const char *prefix, sam_hdr_t *header, uint32_t max_open) {
+    /**
+     * @abstract Prepare to write the outputs of labels through spill files.
+     * @prefix Output prefix, where spill files go to a "spill/" directory
+     * @max_open Most files to keep open at once (outputs and spill files)
+     * @returns The spill state; NULL on failure
+     */
+    spill_t *sp = calloc(1, sizeof(spill_t));
+    if (NULL == sp) return NULL;
+    sp->labels = labels;
+    sp->prefix = prefix;
+    sp->header = header;
+    sp->mru = sp->lru = -1;
+
+    // As few spill files as possible, while copying any of them needs no more outputs than the
+    // slots left (with at least half of the files for outputs)
+    if (max_open < 4) max_open = 4;
+    sp->n_buckets = 1;
+    while (sp->n_buckets < max_open / 2 && (uint64_t) sp->n_buckets * (max_open - sp->n_buckets) < labels->n) {
+        sp->n_buckets++;
+    }
+    sp->n_slots = max_open - sp->n_buckets;
+
+    sp->dir = malloc(strlen(prefix) + 8);
+    sp->state = calloc(labels->n, sizeof(uint8_t));
+    sp->created = calloc(labels->n, sizeof(bool));
+    sp->slot_of = malloc(labels->n * sizeof(int32_t));
+    sp->slots = calloc(sp->n_slots, sizeof(spill_slot_t));
+    sp->buckets = calloc(sp->n_buckets, sizeof(BGZF *));
+    if (NULL == sp->dir || NULL == sp->state || NULL == sp->created || NULL == sp->slot_of ||
+        NULL == sp->slots || NULL == sp->buckets) {
+        log_msg("Fail to allocate memory for spilling outputs", ERROR);
+        spill_destroy(sp);
+        return NULL;
+    }
+    for (uint32_t lid = 0; lid < labels->n; lid++) sp->slot_of[lid] = -1;
+    strcpy(sp->dir, prefix);
+    strcat(sp->dir, "spill/");
+    if (0 != mkdir(sp->dir, 0700) && EEXIST != errno) {
+        log_msg("Fail to create directory %s (Error: %s)", ERROR, sp->dir, strerror(errno));
+        spill_destroy(sp);
+        return NULL;
+    }
+
+    for (uint32_t b = 0; b < sp->n_buckets; b++) {
+        char *path = bucket_path(sp, b);
+        if (NULL == path || NULL == (sp->buckets[b] = bgzf_open(path, TMP_MODE))) {
+            log_msg("Fail to create spill file %s", ERROR, NULL == path ? sp->dir : path);
+            free(path);
+            spill_destroy(sp);
+            return NULL;
+        }
+        free(path);
+        if (NULL != HTS_POOL.pool) bgzf_thread_pool(sp->buckets[b], HTS_POOL.pool, HTS_POOL.qsize);
+    }
+    log_msg("Keeping up to %u outputs open, with %u spill files", INFO, sp->n_slots, sp->n_buckets);
+    return sp;
+}
+
+int8_t spill_write(spill_t *sp, uint32_t lid, bam1_t *read, raw_read_t *raw) {
+    /**
+     * @abstract Write a read of a label: straight to its output if it is one of the first labels
+     * seen (as long as slots are left), to its spill file otherwise.
+     * @raw If not NULL, the raw bytes of the same read, which are written as is
+     * @returns 0 on success; 1 on writing failure
+     */
+    if (LABEL_UNSEEN == sp->state[lid]) {
+        sp->state[lid] = sp->n_direct < sp->n_slots ? LABEL_DIRECT : LABEL_SPILLED;
+        sp->n_direct += LABEL_DIRECT == sp->state[lid];
+    }
+    if (LABEL_DIRECT == sp->state[lid]) {
+        BGZF *out = spill_output(sp, lid);
+        if (NULL == out) return 1;
+        return (NULL != raw ? raw_write1(out, raw) : bam_write1(out, read)) < 0 ? 1 : 0;
+    }
+
+    BGZF *bucket = sp->buckets[lid % sp->n_buckets];
+    if (bgzf_write(bucket, &lid, sizeof(uint32_t)) != sizeof(uint32_t) ||
+        (NULL != raw ? raw_write1(bucket, raw) : bam_write1(bucket, read)) < 0) {
+        log_msg("Fail to write to spill file", ERROR);
+        return 1;
+    }
+    return 0;
+}
+
+BGZF *label_output(label_set_t *labels, uint32_t lid) {
+    /**
+     * @abstract The BGZF handle of the output of a label, flushed so raw BGZF blocks can be
+     * appended (with spill files, the output is opened as needed).
+     * @returns The handle; NULL on failure
+     */
+    BGZF *out = NULL == labels->spill ? labels->by_id[lid]->fp->fp.bgzf : spill_output(labels->spill, lid);
+    // Waits for blocks still being compressed by the thread pool
+    if (NULL == out || bgzf_flush(out) < 0) {
+        log_msg("Fail to flush output for %s", ERROR, labels->by_id[lid]->label);
+        return NULL;
+    }
+    return out;
+}
+
+int8_t spill_finish(spill_t *sp) {
+    /**
+     * @abstract Copy the spill files to the outputs one after the other, create the outputs of
+     * labels without reads, and close every output.
+     * @returns 0 on success; 1 on failure
+     */
+    int8_t return_val = 0;
+    raw_read_t *raw = raw_read_init();
+    if (NULL == raw) return 1;
+
+    for (uint32_t b = 0; b < sp->n_buckets && 0 == return_val; b++) {
+        char *path = bucket_path(sp, b);
+        if (NULL == path || 0 != bgzf_close(sp->buckets[b])) {
+            sp->buckets[b] = NULL;
+            log_msg("Fail to write spill file", ERROR);
+            free(path);
+            return_val = 1;
+            break;
+        }
+        sp->buckets[b] = NULL;
+
+        BGZF *bucket = bgzf_open(path, "r");
+        if (NULL == bucket) {
+            log_msg("Fail to open spill file %s", ERROR, path);
+            free(path);
+            return_val = 1;
+            break;
+        }
+        if (NULL != HTS_POOL.pool) bgzf_thread_pool(bucket, HTS_POOL.pool, HTS_POOL.qsize);
+        uint32_t lid;
+        ssize_t got;
+        while (sizeof(uint32_t) == (got = bgzf_read(bucket, &lid, sizeof(uint32_t)))) {
+            BGZF *out;
+            if (lid >= sp->labels->n || raw_read1(bucket, raw) < 0) {
+                log_msg("Spill file %s is corrupted", ERROR, path);
+                return_val = 1;
+                break;
+            }
+            if (NULL == (out = spill_output(sp, lid)) || raw_write1(out, raw) < 0) {
+                return_val = 1;
+                break;
+            }
+        }
+        if (0 != got && 0 == return_val) {
+            log_msg("Spill file %s is truncated", ERROR, path);
+            return_val = 1;
+        }
+        bgzf_close(bucket);
+        if (0 != unlink(path)) {
+            log_msg("Fail to remove spill file (%s)", WARNING, path);
+        }
+        free(path);
+    }
+
+    // Every label gets an output, as without spill files
+    for (uint32_t lid = 0; lid < sp->labels->n && 0 == return_val; lid++) {
+        if (!sp->created[lid] && NULL == spill_output(sp, lid)) return_val = 1;
+    }
+    while (sp->mru >= 0) {
+        if (0 != slot_close(sp, sp->mru)) return_val = 1;
+    }
+    raw_read_destroy(raw);
+    if (0 == return_val && 0 != rmdir(sp->dir)) {
+        log_msg("Fail to remove spill directory (%s)", WARNING, sp->dir);
+    }
+    return return_val;
+}
+
+void spill_destroy(spill_t *sp) {
+    if (NULL == sp) return;
+    while (NULL != sp->slots && sp->mru >= 0) slot_close(sp, sp->mru);
+    for (uint32_t b = 0; NULL != sp->buckets && b < sp->n_buckets; b++) {
+        if (NULL != sp->buckets[b]) bgzf_close(sp->buckets[b]);
+    }
+    free(sp->buckets);
+    free(sp->slots);
+    free(sp->slot_of);
+    free(sp->created);
+    free(sp->state);
+    free(sp->dir);
+    free(sp);
+}
@@ -0,0 +1,61 @@
+//
+// Created by Yen-Chung Chen on 10/16/26.
+//
+
+#ifndef SCBAMSPLIT_SPILL_H
+#define SCBAMSPLIT_SPILL_H
+#include <stdbool.h>
+#include "htslib/sam.h"
+#include "hash.h"
+#include "rawbam.h"
+
+// Files kept open besides the outputs (input, index, metadata, standard streams...)
+#define SPILL_FD_RESERVE 32
+
+enum spill_label_state {
+    LABEL_UNSEEN,              /* no read so far */
+    LABEL_DIRECT,              /* written to its output as reads come */
+    LABEL_SPILLED              /* written to a spill file first */
+};
+
+// An open output in the LRU list of spill_t
+typedef struct {
+    uint32_t lid;
+    BGZF *fp;
+    int32_t prev;              /* more recently used slot; -1 for the first */
+    int32_t next;
+} spill_slot_t;
+
+// Outputs of more labels than files can be open at once (e.g., one per cell). While the input is
+// read, the first labels seen keep their output open and the reads of later labels go to a few
+// spill files (label ID, then the BAM record), labels being spread over files by ID. Spill files
+// are then copied to the outputs one after the other, each holding few enough labels for all of
+// their outputs to stay open, with the least recently used output closed when a slot is needed.
+typedef struct spill {
+    label_set_t *labels;
+    const char *prefix;        /* output prefix (see label_outpath()) */
+    sam_hdr_t *header;
+    char *dir;
+    uint8_t *state;            /* enum spill_label_state of each label */
+    bool *created;             /* whether the output of each label exists (outputs are appended to) */
+    int32_t *slot_of;          /* slot of each label; -1 if its output is closed */
+    spill_slot_t *slots;
+    uint32_t n_slots;
+    uint32_t n_open;
+    int32_t mru;               /* most recently used slot */
+    int32_t lru;
+    BGZF **buckets;
+    uint32_t n_buckets;
+    uint32_t n_direct;
+} spill_t;
+
+uint64_t open_file_limit(void);
+uint64_t raise_open_file_limit(void);
+uint32_t open_file_budget(uint64_t limit);
+spill_t *spill_init(label_set_t *labels, const char *prefix, sam_hdr_t *header, uint32_t max_open);
+int8_t spill_write(spill_t *sp, uint32_t lid, bam1_t *read, raw_read_t *raw);
+BGZF *label_output(label_set_t *labels, uint32_t lid);
+int8_t spill_finish(spill_t *sp);
+void spill_destroy(spill_t *sp);
+
+#endif //SCBAMSPLIT_SPILL_H
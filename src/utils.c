@@ -16,6 +16,7 @@
 #include "sys/stat.h" /* stat() and mkdir() */
 #include "thread_pool.h"
 #include "hash.h"
+#include "spill.h"
 
 
 uint64_t max_strlen(char **strarr);
@@ -25,6 +26,8 @@ void show_usage() {
     fprintf(stderr, "Version: v0.3.1 (Dependent on htslib v1.17)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Usage: scbamsplit -f path -m path\n");
+    fprintf(stderr, "       scbamsplit finalize -f path -m path -o path (after all --shard runs)\n");
+    fprintf(stderr, "       scbamsplit compile-meta metadata.csv output (then use the output as -m)\n");
     fprintf(stderr, "Options:\n\n");
     fprintf(stderr, "    Generic:\n");
     fprintf(stderr, "        [-o path] [-q MAPQ] [-d] [-r read name length] [-M memory usage (in GB)] [-n] [-v (verbosity)] [-h]\n");
@@ -32,7 +35,8 @@ void show_usage() {
     fprintf(stderr, "        [-p platform] [-b CBC tag/field] [-L CBC length] [-u UMI tag/field] [-l UMI length]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "    -f/--file: the path for input bam file\n");
-    fprintf(stderr, "    -m/--meta: the path for input metadata an unquoted two-column csv with column names)\n");
+    fprintf(stderr, "    -m/--meta: the path for input metadata an unquoted two-column csv or tsv with column names, may be gzipped)\n");
+    fprintf(stderr, "        Can be given several times: outputs of each metadata go to a subdirectory named after its file\n");
     fprintf(stderr, "    -o/--output: the path to export bam files to default: ./)\n");
     fprintf(stderr, "    -q/--mapq: Minimal MAPQ threshold for output default: 0)\n");
     fprintf(stderr, "    -p/--platform: Pre-fill locations and lengths for CBC and UMI (Supported platform: 10Xv2, 10Xv3, sciRNAseq3\n");
@@ -46,12 +50,41 @@ void show_usage() {
     fprintf(stderr, "    -l/--umi-length: The length of the UMI default: 20)\n");
     fprintf(stderr, "    -r/--rn-length: The length of the read name (default: 70)\n");
     fprintf(stderr, "    -M/--mem: The estimated maximum amount of memory to use (In GB, default: 4)\n");
-    fprintf(stderr, "    -@/--threads: Setting the number of threads to use (default: 1)\n");
+    fprintf(stderr, "    -@/--threads: Setting the number of threads to use, including BAM compression (default: 1)\n");
+    fprintf(stderr, "    --shard: Only process the i-th of N slices of the input (e.g., --shard 3/16) for array jobs;\n");
+    fprintf(stderr, "        run \"scbamsplit finalize\" with the same options once all slices are done\n");
+    fprintf(stderr, "    --mphf: Look up barcodes through a minimal perfect hash built at startup (faster and smaller\n");
+    fprintf(stderr, "        for metadata with millions of barcodes)\n");
+    fprintf(stderr, "    --prefilter: Reject reads of cells not in the metadata with a Bloom filter before anything else\n");
+    fprintf(stderr, "        is looked up (for metadata covering a small part of the cells)\n");
+    fprintf(stderr, "    --cb-sorted: The input is sorted by cell barcode (samtools sort -t CB; detected from the header\n");
+    fprintf(stderr, "        otherwise), so reading stops after the last barcode in the metadata (without -d)\n");
+    fprintf(stderr, "    --correct: Assign cell barcodes not in the metadata to the one barcode of the metadata that is a single\n");
+    fprintf(stderr, "        substitution away (e.g., with -b CR), using base qualities in CY to break ties; barcodes\n");
+    fprintf(stderr, "        of more than 32 bases or with a suffix other than -<number> are never corrected\n");
+    fprintf(stderr, "    --write-buffer: Collect this many MB of compressed output per label before writing it in one go\n");
+    fprintf(stderr, "        (for network filesystems; all buffers together are kept within a quarter of -M)\n");
+    fprintf(stderr, "    --max-open: Number of files kept open at once (default: from the open file limit); with more\n");
+    fprintf(stderr, "        labels (e.g., one per cell), reads are spilled to temporary files and copied to the outputs\n");
+    fprintf(stderr, "    --level: Compression level of the output BAM files (0 - 9) (default: htslib default)\n");
+    fprintf(stderr, "    --tmp-level: Compression level of temporary files (0 - 9, or u for uncompressed) (default: 1)\n");
     fprintf(stderr, "    -n/--dry-run: Only print out parameters\n");
     fprintf(stderr, "    -v/--verbose: Set verbosity level (1 - 5) (default: 2, 3 if -v provided without a value)\n");
     fprintf(stderr, "    -h/--help: Show this documentation\n");
 }
 
+void attach_hts_pool(samFile *fp) {
+    /**
+     * @abstract Let a SAM/BAM handle use the shared htslib thread pool (if one is created)
+     * for BGZF compression or decompression.
+     * @fp A file handle from sam_open()
+     */
+    if (NULL == fp || NULL == HTS_POOL.pool) return;
+    if (0 != hts_set_opt(fp, HTS_OPT_THREAD_POOL, &HTS_POOL)) {
+        log_msg("Fail to attach the thread pool to %s", WARNING, fp->fn);
+    }
+}
+
 char * get_time() {
     /**
      * Need to be freed!
@@ -306,6 +339,13 @@ char * tname_init(char * tmpdir, char * prefix, int32_t uid_length, uint32_t oid
     return name;
 }
 
+static const char *merge_key(bam1_t *read) {
+    // The sorting key appended by fill_chunk(), as a pointer into the read
+    aux_field_t sk = {.tag = {'S', 'K'}};
+    if (aux_scan(read, &sk, 1) < 1) return "";
+    return sk.val;
+}
+
 int8_t merge_bam_nway(char *tmpdir, str_vec_t *bam_vec, uint32_t oid, char *prefix, int64_t n) {
     char **farray = bam_vec->str_arr;
     char **ffarray = calloc(n, sizeof(char*));
@@ -313,9 +353,9 @@ int8_t merge_bam_nway(char *tmpdir, str_vec_t *bam_vec, uint32_t oid, char *pref
     sam_hdr_t **header_arr = calloc(n, sizeof(sam_hdr_t*));
     bam1_t **rarray = calloc(n, sizeof(bam1_t*));
     int32_t *rstat_arr = calloc(n, sizeof(int32_t));
-    char **key_arr = calloc(n, sizeof(char*));
-    char *key_temp = calloc(KEY_SIZE, sizeof(char));
-    int8_t *tag_stat_arr = calloc(n, sizeof(int8_t));
+    // Sorting keys point into the current read of each input and are only looked up
+    // again when that input moves to its next read
+    const char **key_arr = calloc(n, sizeof(char*));
 
 
     for (int64_t i = 0; i < n; i++) {
@@ -324,14 +364,16 @@ int8_t merge_bam_nway(char *tmpdir, str_vec_t *bam_vec, uint32_t oid, char *pref
         strcat(ffarray[i], farray[i]);
 
         fpa[i] = sam_open(ffarray[i], "r");
+        attach_hts_pool(fpa[i]);
         header_arr[i] = sam_hdr_read(fpa[i]);
         rarray[i] = bam_init1();
         rstat_arr[i] = sam_read1(fpa[i], header_arr[i], rarray[i]);
-        key_arr[i] = calloc(KEY_SIZE, sizeof(char));
+        if (rstat_arr[i] >= 0) key_arr[i] = merge_key(rarray[i]);
     }
 
     char *mname = tname_init(tmpdir, prefix, 5, oid);
-    htsFile* tfp = sam_open(mname, "wb");
+    htsFile* tfp = sam_open(mname, TMP_MODE);
+    attach_hts_pool(tfp);
 
     int wr_stat;
     int8_t return_val = 0;
@@ -350,25 +392,23 @@ int8_t merge_bam_nway(char *tmpdir, str_vec_t *bam_vec, uint32_t oid, char *pref
     while (any_r == 1) {
         first_item = true;
         key_min_id = 0;
-        for (int8_t i = 0; i < n; i++) {
+        for (int64_t i = 0; i < n; i++) {
             if (rstat_arr[i] < 0) continue;
-            tag_stat_arr[i] = fetch_tag(rarray[i], "SK", key_arr[i]);
 
             if (first_item) {
-                strcpy(key_temp, key_arr[i]);
                 first_item = false;
                 key_min_id = i;
                 continue;
             }
 
-            if (strcmp(key_temp, key_arr[i]) > 0) {
-                strcpy(key_temp, key_arr[i]);
+            if (strcmp(key_arr[key_min_id], key_arr[i]) > 0) {
                 key_min_id = i;
             }
         }
 
         wr_stat = sam_write1(tfp, header_arr[0], rarray[key_min_id]);
         rstat_arr[key_min_id] = sam_read1(fpa[key_min_id], header_arr[key_min_id], rarray[key_min_id]);
+        if (rstat_arr[key_min_id] >= 0) key_arr[key_min_id] = merge_key(rarray[key_min_id]);
 
         for (int64_t i = 0; i < n; i++) {
             if (rstat_arr[i] >= 0) {
@@ -393,7 +433,6 @@ int8_t merge_bam_nway(char *tmpdir, str_vec_t *bam_vec, uint32_t oid, char *pref
         sam_hdr_destroy(header_arr[i]);
         bam_destroy1(rarray[i]);
         sam_close(fpa[i]);
-        free(key_arr[i]);
         if (unlink(ffarray[i]) != 0) rm_err = true;
         free(ffarray[i]);
         if (rm_err) {
@@ -406,8 +445,6 @@ int8_t merge_bam_nway(char *tmpdir, str_vec_t *bam_vec, uint32_t oid, char *pref
     free(header_arr);
     free(rarray);
     free(key_arr);
-    free(key_temp);
-    free(tag_stat_arr);
     str_vec_destroy(bam_vec);
     sam_close(tfp);
 
@@ -502,17 +539,161 @@ char* merge_bams(char * tmpdir) {
     return sorted_path;
 }
 
-int8_t read_dump(rt2label *r2l, rt2label *lout, label2fp *l2fp, label2fp *fout,
-                 char * this_CB, sam_hdr_t *header, bam1_t *read) {
+int32_t view_cmp(tag_view_t *view, const char *str) {
+    /**
+     * @abstract strcmp() between a tag view and a NUL-terminated string
+     */
+    size_t l_str = strlen(str);
+    size_t l_min = (size_t) view->len < l_str ? (size_t) view->len : l_str;
+    int32_t cmp = memcmp(view->s, str, l_min);
+    if (0 != cmp) return cmp;
+    return (size_t) view->len == l_str ? 0 : ((size_t) view->len < l_str ? -1 : 1);
+}
+
+void view_cpy(char *dest, tag_view_t *view) {
+    /**
+     * @abstract Copy a tag view into a NUL-terminated string; dest has to hold view->len + 1 bytes
+     */
+    memcpy(dest, view->s, view->len);
+    dest[view->len] = '\0';
+}
+
+void cb_run_init(cb_run_t *run, bctable_t *bct, bool sorted) {
+    /**
+     * @abstract Start with no barcode looked up.
+     * @sorted Whether the input is declared sorted by cell barcode, to stop once every barcode
+     * of bct has been passed
+     */
+    *run = (cb_run_t) {.len = -1, .fixed = -2, .sorted = sorted};
+    if (sorted) run->n_left = bct->n_keys + HASH_COUNT(bct->r2l);
+}
+
+void cb_run_destroy(cb_run_t *run) {
+    free(run->cb);
+    run->cb = NULL;
+}
+
+int64_t cb_run_find(cb_run_t *run, bctable_t *bct, tag_view_t *cb) {
+    /**
+     * @abstract Look up the label of a cell barcode unless it is the one looked up last.
+     * @run The last barcode; NULL to always look up
+     * @returns As bctable_find()
+     */
+    if (NULL == run) return bctable_find(bct, cb->s, cb->len);
+    if (cb->len == run->len && 0 == memcmp(cb->s, run->cb, cb->len)) return run->val;
+
+    if (run->sorted && run->len >= 0) {
+        int32_t cmp = memcmp(cb->s, run->cb, cb->len < run->len ? cb->len : run->len);
+        if (0 == cmp) cmp = cb->len - run->len;
+        if (cmp < 0) {
+            log_msg("The input is not sorted by cell barcode (%.*s after %.*s); reading it to the end", WARNING,
+                    cb->len, cb->s, run->len, run->cb);
+            run->sorted = false;
+        } else if (0 == run->n_left) {
+            // A new barcode after every barcode of the metadata
+            run->done = true;
+        }
+    }
+    if (cb->len >= run->cap) {
+        char *grown = realloc(run->cb, cb->len + 1);
+        if (NULL == grown) return bctable_find(bct, cb->s, cb->len);
+        run->cb = grown;
+        run->cap = cb->len + 1;
+    }
+    memcpy(run->cb, cb->s, cb->len);
+    run->len = cb->len;
+    run->val = bctable_find(bct, cb->s, cb->len);
+    run->fixed = -2;
+    if (run->sorted && run->val >= 0 && run->n_left > 0) run->n_left--;
+    return run->val;
+}
+
+bool cb_sorted_header(sam_hdr_t *header, tag_meta_t *cb_meta) {
+    /**
+     * @abstract Check whether the header declares the input sorted by the cell barcode tag, as in
+     * the @HD SS field written by samtools sort -t (e.g., "SS:coordinate:TAG:CB").
+     */
+    if (READ_TAG != cb_meta->location) return false;
+    kstring_t ss = KS_INITIALIZE;
+    bool sorted = false;
+    // Only the sub-sort samtools writes for a tag counts ("<order>:TAG:<tag>"), not any value
+    // that happens to end with the tag name
+    if (0 == sam_hdr_find_tag_hd(header, "SS", &ss) && ss.l > 7) {
+        sorted = 0 == strncmp(ss.s + ss.l - 7, ":TAG:", 5) && 0 == strncmp(ss.s + ss.l - 2, cb_meta->tag_name, 2);
+    }
+    ks_free(&ss);
+    return sorted;
+}
+
+static int64_t correct_cb(bam1_t *read, bctable_t *bct, tag_view_t *cb, cb_run_t *run) {
+    // Correct a cell barcode not in the metadata, breaking ties with its base qualities (CY) if any.
+    // A run of reads from one cell is corrected once, unless the qualities of each read decide
+    bool in_run = NULL != run && cb->len == run->len && 0 == memcmp(cb->s, run->cb, cb->len);
+    if (in_run && run->fixed > -2) return run->fixed;
+    aux_field_t cy = {{'C', 'Y'}, NULL, -1};
+    aux_scan(read, &cy, 1);
+    bool by_qual;
+    int64_t val = bctable_correct(bct, cb->s, cb->len, cy.len > 0 ? cy.val : NULL, cy.len, &by_qual);
+    if (in_run && !by_qual) run->fixed = val;
+    return val;
+}
+
+int64_t label_of_read(bam1_t *read, bctable_t *bct, tag_meta_t *cb_meta, tag_meta_t *ub_meta, int64_t qthres,
+                      tag_view_t *cb, cb_run_t *run) {
+    /**
+     * @abstract Decide which label a read goes to when splitting: it needs a MAPQ of at least
+     * qthres, a cell barcode in the metadata, and a UMI.
+     * @cb Returns the cell barcode (if found)
+     * @run The last barcode looked up (see cb_run_find()); may be NULL
+     * @returns The label value (see bctable_find()); -1 if the read is not kept
+     */
+    tag_view_t ub;
+    if (read->core.qual < qthres) return -1;
+
+    if (NULL != bct->bloom) {
+        // With the prefilter, most reads are expected to come from cells outside the metadata,
+        // so they are dropped before their UMI is looked for
+        if (0 != BARCODES.cb(read, cb_meta, NULL, cb, NULL)) return -1;
+        int64_t lid = cb_run_find(run, bct, cb);
+        if (lid < 0 && bct->correct) lid = correct_cb(read, bct, cb, run);
+        if (lid < 0 || 0 != BARCODES.ub(read, ub_meta, NULL, &ub, NULL)) return -1;
+        return lid;
+    }
+    // Ignore reads without CB and UMI for consistency
+    if (0 != BARCODES.both(read, cb_meta, ub_meta, cb, &ub)) return -1;
+    int64_t lid = cb_run_find(run, bct, cb);
+    if (lid < 0 && bct->correct) lid = correct_cb(read, bct, cb, run);
+    return lid;
+}
+
+int8_t read_dump(label_set_t *labels, int64_t val, sam_hdr_t *header, bam1_t *read, raw_read_t *raw) {
+    /**
+     * @abstract Write a read to the output of every label of its barcode.
+     * @val The label value (from bctable_find()); nothing is written if it is negative
+     * @read The read to write
+     * @raw If not NULL, the raw bytes of the same read, which are copied to the outputs as is
+     * @returns 0 on success; 1 on writing failure
+     */
     int32_t write_to_bam = 0;
-    HASH_FIND_STR(r2l, (char *) this_CB, lout);
-
-    // If the CBC is found
-    if (lout) {
-        // Query the CBC-to-output table
-        HASH_FIND_STR(l2fp, lout->label, fout);
-        if (fout) {
-            write_to_bam = sam_write1(fout->fp, header, read);
+    if (val < 0) return 0;
+
+    // A barcode in several labels has the same encoded record written to each of them
+    uint32_t lval = (uint32_t) val;
+    const uint32_t *lids;
+    uint32_t n_lids = label_ids(labels, &lval, &lids);
+    for (uint32_t i = 0; i < n_lids; i++) {
+        if (NULL != labels->spill) {
+            if (0 != spill_write(labels->spill, lids[i], read, raw)) return 1;
+            continue;
+        }
+        // Outputs are indexed by label ID
+        label2fp *fout = labels->by_id[lids[i]];
+        if (fout->fp) {
+            if (NULL != raw) {
+                write_to_bam = raw_write1(fout->fp->fp.bgzf, raw);
+            } else {
+                write_to_bam = sam_write1(fout->fp, header, read);
+            }
             if (write_to_bam < 0) {
                 // Decide how to deal with writing failure outside
                 return 1;
@@ -522,44 +703,59 @@ int8_t read_dump(rt2label *r2l, rt2label *lout, label2fp *l2fp, label2fp *fout,
     return 0;
 }
 
-int8_t deduped_dump(rt2label *r2l, rt2label *lout, label2fp *l2fp, label2fp *fout, char *tmpdir, char *sorted_path,
+static bool barcode_changed(tag_view_t *view, bc_entry_t *last, char *last_str) {
+    /**
+     * @abstract Tell whether a barcode differs from the one of the previous read and remember it.
+     * Packable barcodes are compared by their 2-bit keys; others as strings.
+     * @last The previous barcode if it was packed (len is 0 otherwise, or before the first read)
+     * @last_str The previous barcode if it was not packed
+     */
+    bc_entry_t e;
+    if (0 == bc_pack(view->s, view->len, &e)) {
+        bool changed = 0 == last->len || !bc_same(&e, last);
+        *last = e;
+        return changed;
+    }
+    bool changed = 0 != last->len || 0 != view_cmp(view, last_str);
+    last->len = 0;
+    if (changed) view_cpy(last_str, view);
+    return changed;
+}
+
+int8_t deduped_dump(bctable_t *bct, label_set_t *labels, char *tmpdir, char *sorted_path,
                     bam1_t *read, char *bc_tag, char *umi_tag, tag_meta_t *cb_meta, tag_meta_t *ub_meta) {
     int32_t read_stat;
     samFile *sfp = sam_open(sorted_path, "r");
+    attach_hts_pool(sfp);
     sam_hdr_t *sheader = sam_hdr_read(sfp);
     char *current_UB;
-    char *this_UB;
     char *RN_keep;
     char *this_RN;
     char *current_CB;
-    char *this_CB;
 
-    current_UB = (char *) calloc(UB_LENGTH, sizeof(char));
-    this_UB = (char *) calloc(UB_LENGTH, sizeof(char));
+    // Barcodes from read names are not cut to the tag length, but cannot be longer than the name
+    current_UB = (char *) calloc(UB_LENGTH > RN_SIZE ? UB_LENGTH : RN_SIZE, sizeof(char));
     RN_keep = (char *) calloc(RN_SIZE, sizeof(char));
     this_RN = (char *) calloc(RN_SIZE, sizeof(char));
-    current_CB = (char *) calloc(CB_LENGTH, sizeof(char));
-    this_CB = (char *) calloc(CB_LENGTH, sizeof(char));
+    current_CB = (char *) calloc(CB_LENGTH > RN_SIZE ? CB_LENGTH : RN_SIZE, sizeof(char));
 
 
     bool first_read = true;
-    int32_t same_CB = 0;
-    int32_t same_UB = 0;
+    bool new_CB, new_UB;
+    bc_entry_t last_CB = {0}, last_UB = {0};
     int32_t to_export = 0;
     int32_t write_to_bam = 0;
     int8_t return_val = 0;
+    tag_view_t cb_view;
+    tag_view_t ub_view;
+    cb_run_t run;
+    cb_run_init(&run, bct, false);
     while (0 <= (read_stat = sam_read1(sfp, sheader, read))) {
         // Get read metadata
-        int8_t cb_stat = get_CB(read, cb_meta, this_CB);
-        if (-1 == cb_stat) {
+        int8_t bc_stat = BARCODES.both(read, cb_meta, ub_meta, &cb_view, &ub_view);
+        if (0 != bc_stat) {
             return_val = 1;
-            log_msg("Cannot retrieve cell barcode from the sorted BAM", ERROR);
-            goto free_res_and_exit;
-        }
-        int8_t ub_stat = get_UB(read, ub_meta, this_UB);
-        if (-1 == ub_stat) {
-            return_val = 1;
-            log_msg("Cannot retrieve UMI from the sorted BAM", ERROR);
+            log_msg("Cannot retrieve cell barcode or UMI from the sorted BAM", ERROR);
             goto free_res_and_exit;
         }
         char * rn_ptr;
@@ -573,27 +769,14 @@ int8_t deduped_dump(rt2label *r2l, rt2label *lout, label2fp *l2fp, label2fp *fou
         // and all secondary mappings of the same read.
         // With the sorting mechanism, this will be the first read of each
         // CB-UMI combo.
-        if (first_read) {
-            first_read = !first_read;
-            strcpy(current_CB, this_CB);
-            strcpy(current_UB, this_UB);
-            strcpy(RN_keep, this_RN);
-        }
-
-
         // Check if we have entered the next CB-UMI combo.
         // Update the RN to keep if so.
-        same_CB = strcmp(current_CB, this_CB);
-        same_UB = strcmp(current_UB, this_UB);
-        if (0 != same_CB || 0 != same_UB) {
+        new_CB = barcode_changed(&cb_view, &last_CB, current_CB);
+        new_UB = barcode_changed(&ub_view, &last_UB, current_UB);
+        if (first_read || new_CB || new_UB) {
+            first_read = false;
             strcpy(RN_keep, this_RN);
         }
-        if (0 != same_CB) {
-            strcpy(current_CB, this_CB);
-        }
-        if (0 != same_UB) {
-            strcpy(current_UB, this_UB);
-        }
 
         // Export reads with the highest MAPQ per CB-UMI combo
         to_export = strcmp(RN_keep, this_RN);
@@ -602,10 +785,13 @@ int8_t deduped_dump(rt2label *r2l, rt2label *lout, label2fp *l2fp, label2fp *fou
         }
 
         // Exporting process
-        int8_t rdump_stat = read_dump(r2l, lout, l2fp, fout, this_CB, sheader, read);
+        // Reads are sorted by cell barcode here
+        int64_t val = cb_run_find(&run, bct, &cb_view);
+        if (val < 0 && bct->correct) val = correct_cb(read, bct, &cb_view, &run);
+        int8_t rdump_stat = read_dump(labels, val, sheader, read, NULL);
         if (0 != rdump_stat) {
             return_val = 1;
-            log_msg("Fail to write sorted reads to split BAM file (%s)", ERROR, lout->label);
+            log_msg("Fail to write sorted reads to split BAM file (%.*s)", ERROR, cb_view.len, cb_view.s);
             goto free_res_and_exit;
         }
 
@@ -625,12 +811,11 @@ int8_t deduped_dump(rt2label *r2l, rt2label *lout, label2fp *l2fp, label2fp *fou
     }
 
     free_res_and_exit:
+        cb_run_destroy(&run);
         free(current_UB);
-        free(this_UB);
         free(RN_keep);
         free(this_RN);
         free(current_CB);
-        free(this_CB);
         sam_close(sfp);
         sam_hdr_destroy(sheader);
         free(sorted_path);
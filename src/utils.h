@@ -4,6 +4,8 @@
 #ifndef SCBAMSPLIT_UTILS_H
 #define SCBAMSPLIT_UTILS_H
 #include "hash.h"
+#include "rawbam.h"
+#include "bctable.h"
 typedef struct {
     char *key;
     bam1_t *read;
@@ -21,8 +23,28 @@ typedef struct {
     uint8_t field;
     uint8_t length;
 } tag_meta_t;
+
+// A tag value or read name field pointing into a read; not NUL-terminated
+typedef struct {
+    const char *s;
+    int32_t len;
+} tag_view_t;
 #include "sort.h"
 
+// The last cell barcode looked up and its label value, so a run of reads from one cell is looked
+// up once. With input sorted by cell barcode, it also tells when every barcode in the metadata
+// has been passed.
+typedef struct {
+    char *cb;
+    int32_t len;               /* -1 before the first barcode */
+    int32_t cap;
+    int64_t val;
+    int64_t fixed;             /* val corrected (see bctable_correct()); -2 if not known */
+    bool sorted;               /* cleared as soon as the input turns out not to be sorted */
+    uint64_t n_left;           /* barcodes in the metadata not seen yet (with sorted) */
+    bool done;                 /* no later read can be in the metadata (with sorted) */
+} cb_run_t;
+
 ///////////// Logging utilities ////////////////////
 typedef enum {
     DEBUG = 5,
@@ -56,16 +78,23 @@ typedef struct {
 } mnway_args;
 
 void show_usage();
+void attach_hts_pool(samFile *fp);
 int create_directory(char* pathname);
 char * create_tempdir(char *dir);
 str_vec_t * get_bams(char *tmpdir);
 char * tname_init(char * tmpdir, char * prefix, int32_t uid_length, uint32_t oid);
 char * merge_bams(char * tmpdir);
 
-int8_t read_dump(rt2label *r2l, rt2label *lout,
-                 label2fp *l2fp, label2fp *fout,
-                 char * this_CB, sam_hdr_t *header, bam1_t *read);
-int8_t deduped_dump(rt2label *r2l, rt2label *lout, label2fp *l2fp, label2fp *fout, char *tmpdir, char *sorted_path,
+int32_t view_cmp(tag_view_t *view, const char *str);
+void view_cpy(char *dest, tag_view_t *view);
+void cb_run_init(cb_run_t *run, bctable_t *bct, bool sorted);
+void cb_run_destroy(cb_run_t *run);
+int64_t cb_run_find(cb_run_t *run, bctable_t *bct, tag_view_t *cb);
+bool cb_sorted_header(sam_hdr_t *header, tag_meta_t *cb_meta);
+int64_t label_of_read(bam1_t *read, bctable_t *bct, tag_meta_t *cb_meta, tag_meta_t *ub_meta, int64_t qthres,
+                      tag_view_t *cb, cb_run_t *run);
+int8_t read_dump(label_set_t *labels, int64_t val, sam_hdr_t *header, bam1_t *read, raw_read_t *raw);
+int8_t deduped_dump(bctable_t *bct, label_set_t *labels, char *tmpdir, char *sorted_path,
                     bam1_t *read, char *bc_tag, char *umi_tag, tag_meta_t *cb_meta, tag_meta_t *ub_meta);
 
 struct tmp_buf {
@@ -77,4 +106,7 @@ extern char *OUT_PATH;
 extern bool dev;
 extern char* LEVEL_FLAG[6];
 extern int64_t MAX_THREADS;
+extern htsThreadPool HTS_POOL;
+extern char OUT_MODE[4];
+extern char TMP_MODE[4];
 #endif //SCBAMSPLIT_UTILS_H